@@ -0,0 +1,254 @@
+/*
+ * admit.c - admission queue for queries that find no free capacity
+ *
+ * When all upstream sockets (or, with shared sockets, all qids) are in
+ * use a new query used to be dropped, and the client would send it
+ * again a second or more later. Instead it now waits here for up to
+ * --admit-wait ms and is forwarded as soon as a query finishes.
+ *
+ * Every query is on the list of all waiting queries, in the order they
+ * came in, which is also the order they time out in, and on the list
+ * of its client. With --admit-policy=fair the clients take turns, so
+ * one busy client can't keep the others waiting.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "lib.h"
+#include "check.h"
+#include "query.h"
+#include "udp.h"
+#include "timer.h"
+#include "admit.h"
+
+int admit_queue = ADMIT_QUEUE;
+int admit_wait = ADMIT_WAIT;
+int admit_policy = ADMIT_FIFO;
+
+int admit_depth = 0, admit_peak = 0;
+unsigned long admit_released = 0, admit_waited = 0, admit_shed = 0;
+
+struct _client;
+
+typedef struct _waiting {
+  int                 sock;
+  struct sockaddr_in  client;
+  msec_t              arrived;
+  int                 len;
+  struct _waiting    *next, *prev;   /* all of them, oldest first */
+  struct _waiting    *cnext, *cprev; /* those of the same client */
+  struct _client     *c;
+  char                msg[UDP_MAXSIZE+4];
+} waiting_t;
+
+/* a client with queries waiting */
+typedef struct _client {
+  struct in_addr      addr;
+  int                 count;
+  waiting_t          *first, *last;
+  struct _client     *next, *prev;   /* whose turn is next, for fair */
+  struct _client     *hnext;         /* in the hash */
+} client_t;
+
+#define CLIENT_HASH 256
+
+static waiting_t *oldest = NULL, *newest = NULL;
+static client_t  *turn = NULL;       /* ring of clients, next one first */
+static client_t  *hash[CLIENT_HASH];
+static waiting_t *free_waiting = NULL;
+static client_t  *free_client = NULL;
+static tmr_t      shed_timer;
+
+static unsigned hash_addr(struct in_addr a) {
+  unsigned h = a.s_addr;
+  return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) % CLIENT_HASH;
+}
+
+static client_t *find_client(struct in_addr a, int create) {
+  client_t *c;
+  unsigned h = hash_addr(a);
+
+  for (c = hash[h]; c; c = c->hnext)
+    if (c->addr.s_addr == a.s_addr) return c;
+  if (!create) return NULL;
+
+  if ((c = free_client) != NULL) free_client = c->hnext;
+  else c = (client_t *)allocate(sizeof(client_t));
+  memset(c, 0, sizeof(client_t));
+  c->addr = a;
+  c->hnext = hash[h];
+  hash[h] = c;
+
+  /* new clients get the last turn */
+  if (turn == NULL) {
+    c->next = c->prev = c;
+    turn = c;
+  } else {
+    c->next = turn;
+    c->prev = turn->prev;
+    turn->prev->next = c;
+    turn->prev = c;
+  }
+  return c;
+}
+
+static void drop_client(client_t *c) {
+  client_t **cp;
+
+  for (cp = &hash[hash_addr(c->addr)]; *cp != c; cp = &(*cp)->hnext);
+  *cp = c->hnext;
+  if (c->next == c) turn = NULL;
+  else {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    if (turn == c) turn = c->next;
+  }
+  c->hnext = free_client;
+  free_client = c;
+}
+
+/* take w off both lists */
+static void unlink_waiting(waiting_t *w) {
+  client_t *c = w->c;
+
+  if (w->prev) w->prev->next = w->next;
+  else oldest = w->next;
+  if (w->next) w->next->prev = w->prev;
+  else newest = w->prev;
+
+  if (w->cprev) w->cprev->cnext = w->cnext;
+  else c->first = w->cnext;
+  if (w->cnext) w->cnext->cprev = w->cprev;
+  else c->last = w->cprev;
+  if (--c->count == 0) drop_client(c);
+
+  w->next = free_waiting;
+  free_waiting = w;
+  admit_depth--;
+}
+
+static void shed(waiting_t *w) {
+  log_debug(2, "admit: shedding query from %s after %i ms",
+	    inet_ntoa(w->client.sin_addr), (int)(clock_ms - w->arrived));
+  admit_shed++;
+  unlink_waiting(w);
+}
+
+/* shed the queries that have waited too long, and set the timer for
+   the next one */
+static void shed_expired(void *arg) {
+  while (oldest && clock_ms - oldest->arrived >= admit_wait)
+    shed(oldest);
+  if (oldest)
+    timer_set(&shed_timer, oldest->arrived + admit_wait, shed_expired, NULL);
+  else
+    timer_del(&shed_timer);
+}
+
+int admit_pending(void) {
+  return oldest != NULL;
+}
+
+void admit_add(int sock, const char *msg, int len,
+	       const struct sockaddr_in *client) {
+  waiting_t *w;
+  client_t *c, *big;
+
+  if (admit_queue == 0 || len > UDP_MAXSIZE + 4 || len < 2) {
+    admit_shed++;
+    return;
+  }
+
+  /* the client sent it again while it was waiting */
+  if ((c = find_client(client->sin_addr, 0)) != NULL)
+    for (w = c->first; w; w = w->cnext)
+      if (w->client.sin_port == client->sin_port
+	  && memcmp(w->msg, msg, 2) == 0)
+	return;
+
+  if (admit_depth >= admit_queue) {
+    /* make room. With fair, the client with the most queries waiting
+       gives up its oldest */
+    w = oldest;
+    if (admit_policy == ADMIT_FAIR) {
+      big = turn;
+      for (c = turn->next; c != turn; c = c->next)
+	if (c->count > big->count) big = c;
+      w = big->first;
+    }
+    shed(w);
+  }
+
+  if ((w = free_waiting) != NULL) free_waiting = w->next;
+  else w = (waiting_t *)allocate(sizeof(waiting_t));
+  w->sock = sock;
+  memcpy(&w->client, client, sizeof(struct sockaddr_in));
+  w->arrived = clock_ms;
+  w->len = len;
+  memcpy(w->msg, msg, len);
+
+  w->next = NULL;
+  w->prev = newest;
+  if (newest) newest->next = w;
+  else oldest = w;
+  newest = w;
+
+  c = find_client(client->sin_addr, 1);
+  w->c = c;
+  w->cnext = NULL;
+  w->cprev = c->last;
+  if (c->last) c->last->cnext = w;
+  else c->first = w;
+  c->last = w;
+  c->count++;
+
+  if (++admit_depth > admit_peak) admit_peak = admit_depth;
+  if (!timer_pending(&shed_timer))
+    timer_set(&shed_timer, w->arrived + admit_wait, shed_expired, NULL);
+}
+
+void admit_release(void) {
+  waiting_t *w;
+  char msg[UDP_MAXSIZE+4];
+  struct sockaddr_in client;
+  int sock, len;
+
+  while (oldest && query_room()) {
+    if (admit_policy == ADMIT_FAIR) {
+      w = turn->first;
+      turn = turn->next;
+    } else w = oldest;
+
+    admit_released++;
+    admit_waited += clock_ms - w->arrived;
+    sock = w->sock;
+    len = w->len;
+    memcpy(&client, &w->client, sizeof(client));
+    memcpy(msg, w->msg, len);
+    unlink_waiting(w);
+
+    udp_handle_admitted(sock, msg, len, &client);
+  }
+  if (oldest == NULL) timer_del(&shed_timer);
+}
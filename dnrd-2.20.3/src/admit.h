@@ -0,0 +1,63 @@
+/*
+ * admit.h - admission queue for queries that find no free capacity
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_ADMIT_H_
+#define _DNRD_ADMIT_H_
+
+#include <netinet/in.h>
+
+/* defaults for --admit-queue and --admit-wait (ms) */
+#ifndef ADMIT_QUEUE
+#define ADMIT_QUEUE 256
+#endif
+#ifndef ADMIT_WAIT
+#define ADMIT_WAIT 1000
+#endif
+/* upper limit for --admit-queue */
+#ifndef ADMIT_MAX
+#define ADMIT_MAX 4096
+#endif
+
+/* which query goes first when there is room again */
+#define ADMIT_FIFO 0 /* the oldest */
+#define ADMIT_FAIR 1 /* the oldest of the next client, round robin */
+
+extern int admit_queue;  /* max queries waiting, 0 to drop them */
+extern int admit_wait;   /* ms a query may wait */
+extern int admit_policy; /* ADMIT_FIFO or ADMIT_FAIR */
+
+/* queries waiting now, and the most that waited at once */
+extern int admit_depth, admit_peak;
+/* queries let through, their total wait in ms, and queries shed
+   because they waited too long or the queue was full */
+extern unsigned long admit_released, admit_waited, admit_shed;
+
+/* is anything waiting? */
+int admit_pending(void);
+
+/* queue a copy of the request msg from client, that came in on sock.
+   The oldest query is shed (of the client with the most queries, with
+   ADMIT_FAIR) if the queue is full */
+void admit_add(int sock, const char *msg, int len,
+	       const struct sockaddr_in *client);
+
+/* let waiting queries through while there is room for them. Called
+   from the relay loop when the events of a round have been handled */
+void admit_release(void);
+
+#endif /* _DNRD_ADMIT_H_ */
@@ -35,6 +35,44 @@
 #include "common.h"
 #include "lib.h"
 #include "cache.h"
+#include "worker.h"
+#include "upsock.h"
+#include "event.h"
+#include "relay.h"
+#include "listener.h"
+#include "admit.h"
+#include "lookup.h"
+#include "udp.h"
+
+/*
+ * Options that only have a long form. They are numbered above any
+ * character so they don't collide with the short options.
+ */
+enum {
+    OPT_RECV_BATCH = 256,
+    OPT_WORKERS,
+    OPT_PIN_WORKERS,
+    OPT_IO_URING,
+    OPT_SHARED_SOCKETS,
+    OPT_SOCKET_POOL,
+    OPT_SOCKET_USES,
+    OPT_SOCKET_AGE,
+    OPT_BUSY_POLL,
+    OPT_CPU,
+    OPT_ADMIT_QUEUE,
+    OPT_ADMIT_WAIT,
+    OPT_ADMIT_POLICY,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_UPSTREAM_RCVBUF,
+    OPT_UPSTREAM_SNDBUF,
+    OPT_LOOKUP_THREADS,
+    OPT_COALESCE,
+    OPT_COALESCE_WAIT,
+    OPT_FORWARD_RETRIES,
+    OPT_FANOUT,
+    OPT_FANOUT_WIDTH,
+};
 
 /*
  * Definitions for both long and short forms of our options.
@@ -72,6 +110,31 @@ static struct option long_options[] =
 #endif
     {"version",      0, 0, 'v'},
     {"dnrd-root",    1, 0, 'R'},
+    {"recv-batch",   1, 0, OPT_RECV_BATCH},
+    {"workers",      1, 0, OPT_WORKERS},
+    {"pin-workers",  0, 0, OPT_PIN_WORKERS},
+    {"shared-sockets", 1, 0, OPT_SHARED_SOCKETS},
+    {"socket-pool",  1, 0, OPT_SOCKET_POOL},
+    {"socket-uses",  1, 0, OPT_SOCKET_USES},
+    {"socket-age",   1, 0, OPT_SOCKET_AGE},
+    {"busy-poll",    1, 0, OPT_BUSY_POLL},
+    {"cpu",          1, 0, OPT_CPU},
+    {"admit-queue",  1, 0, OPT_ADMIT_QUEUE},
+    {"admit-wait",   1, 0, OPT_ADMIT_WAIT},
+    {"admit-policy", 1, 0, OPT_ADMIT_POLICY},
+    {"rcvbuf",       1, 0, OPT_RCVBUF},
+    {"sndbuf",       1, 0, OPT_SNDBUF},
+    {"upstream-rcvbuf", 1, 0, OPT_UPSTREAM_RCVBUF},
+    {"upstream-sndbuf", 1, 0, OPT_UPSTREAM_SNDBUF},
+    {"lookup-threads", 1, 0, OPT_LOOKUP_THREADS},
+    {"coalesce",     1, 0, OPT_COALESCE},
+    {"coalesce-wait", 1, 0, OPT_COALESCE_WAIT},
+    {"forward-retries", 1, 0, OPT_FORWARD_RETRIES},
+    {"fanout",       1, 0, OPT_FANOUT},
+    {"fanout-width", 1, 0, OPT_FANOUT_WIDTH},
+#ifdef ENABLE_IO_URING
+    {"io-uring",     0, 0, OPT_IO_URING},
+#endif
     {0, 0, 0, 0}
 };
 #endif /* __GNU_LIBRARY__ */
@@ -111,9 +174,11 @@ static void give_help()
     printf("  Valid options are\n");
     printf(
 #ifdef __GNU_LIBRARY__
-"    -a, --address=LOCALADDRESS\n"
+"    -a, --address=LOCALADDRESS[:INTERFACE]\n"
 "                            Only bind to the port on the given address,\n"
-"                            rather than all local addresses.\n"
+"                            rather than all local addresses. Can be given\n"
+"                            more than once. With INTERFACE only queries\n"
+"                            that arrive on that interface are accepted.\n"
 "    -b, --load-balance      Round-Robin load balance forwarding servers.\n"
 #ifndef EXCLUDE_MASTER
 "    -B, --blacklist=FILE    Blacklist all hosts in FILE. Path to FILE is\n"
@@ -156,7 +221,8 @@ static void give_help()
 "    -S, --stats=N[+]        Send cache/query stats to syslog (LOG_INFO)\n"
 "                            every N seconds. Stats will not be resetted if\n"
 "                            the '+' is added\n"
-"    -t, --timeout=N         Set forward DNS server timeout to N.\n"
+"    -t, --timeout=N         Set forward DNS server timeout to N seconds.\n"
+"                            N may have a fraction, like 0.5.\n"
 #ifndef __CYGWIN__
 "    -u, --uid=UID           Username or numeric id to switch to.\n"
 #endif
@@ -165,11 +231,65 @@ static void give_help()
 "    -v, --version           Print out the version number and exit.\n"
 "    -x  PORT                Exclude the port number passed as integer from being selected\n"
 "                            as random source port\n"
+"        --recv-batch=N      Read up to N client requests with one system call.\n"
+"                            Default is 32, maximum is 64.\n"
+"        --workers=N         Run N relay processes that share the listening\n"
+"                            port. Default is 1.\n"
+"        --pin-workers       Pin each worker process to its own CPU.\n"
+"        --cpu=N             Pin the (first) worker to CPU N, the next one\n"
+"                            to N+1 and so on.\n"
+"        --busy-poll=USEC    Poll the sockets for up to USEC microseconds\n"
+"                            before going to sleep. Pins the workers.\n"
+"        --shared-sockets=N  Send queries through N long lived sockets per\n"
+"                            interface instead of new sockets per query.\n"
+"        --socket-pool=N     Keep N spare shared sockets per interface.\n"
+"                            Default is 4.\n"
+"        --socket-uses=N     Replace a shared socket after N queries.\n"
+"                            Default is 1000, 0 for never.\n"
+"        --socket-age=SECS   Replace a shared socket after SECS seconds.\n"
+"                            Default is 60, 0 for never.\n"
+"        --rcvbuf=BYTES      Receive buffer size of the listening sockets.\n"
+"        --sndbuf=BYTES      Send buffer size of the listening sockets.\n"
+"        --upstream-rcvbuf=BYTES\n"
+"        --upstream-sndbuf=BYTES\n"
+"                            The same for the sockets to the servers.\n"
+"                            The system default is used if not given.\n"
+"        --admit-queue=N     Let up to N queries wait for a free socket\n"
+"                            instead of dropping them. Default is 256.\n"
+"        --admit-wait=MS     Drop a waiting query after MS milliseconds.\n"
+"                            Default is 1000.\n"
+"        --admit-policy=fifo|fair\n"
+"                            Let the oldest waiting query go first, or take\n"
+"                            turns between clients. Default is fifo.\n"
+"        --lookup-threads=N  Look requests up in the master database and\n"
+"                            the cache in N threads of their own, and\n"
+"                            keep the relay loop for receiving and\n"
+"                            sending. Default is 0, no extra threads.\n"
+"        --coalesce=N        Let up to N clients asking the same question\n"
+"                            wait for the reply to the query already sent\n"
+"                            for it. Default is 16, 0 to send every one.\n"
+"        --coalesce-wait=MS  Only for a query sent less than MS\n"
+"                            milliseconds ago. Default is 500.\n"
+"        --forward-retries=N Send a query up to N more times to a server\n"
+"                            that doesn't reply, waiting twice as long\n"
+"                            each time, starting from its measured rtt.\n"
+"                            Default is 5, 0 to wait for the timeout.\n"
+"        --fanout=POLICY     all sends a query through all interfaces at\n"
+"                            once, the default. hedge sends it through\n"
+"                            the fastest one first and through the next\n"
+"                            when it is slower than usual.\n"
+"        --fanout-width=N    Send a query through at most N interfaces,\n"
+"                            1 to 8. Default is 3, or the number of\n"
+"                            interfaces if there are fewer.\n"
+#ifdef ENABLE_IO_URING
+"        --io-uring          Use io_uring for the relay sockets when the\n"
+"                            kernel supports it, epoll otherwise.\n"
+#endif
 
 #else /* __GNU_LIBRARY__ */
 
-"    -a IPADDR Only bind to the port on the given address, rather than all\n"
-"              local addresses\n"
+"    -a IPADDR[:INTERFACE] Only bind to the port on the given address,\n"
+"              rather than all local addresses. Can be given more than once\n"
 "    -b        Round-Robin load balance forwarding servers\n"
 #ifndef EXCLUDE_MASTER
 "    -B        Blacklist all hosts in FILE. FILE is relative\n"
@@ -209,7 +329,7 @@ static void give_help()
 "              backup servers).\n"
 "    -S N[+]   Send cache/query stats to syslog (LOG_INFO) every N seconds.\n"
 "              Stats will not be resetted if the '+' is added\n"
-"    -t N      Set forward DNS server timeout to N\n"
+"    -t N      Set forward DNS server timeout to N seconds (0.5 is ok)\n"
 #ifndef __CYGWIN__
 "    -u UID    Username or numeric id to switch to\n"
 #endif
@@ -265,11 +385,14 @@ int parse_args(int argc, char **argv)
 	if (c == -1) break;
 	switch(c) {
 	  case 'a': {
-	      if (!inet_aton(optarg, &recv_addr.sin_addr)) {
-		  log_msg(LOG_ERR, "%s: Bad ip address \"%s\"\n",
+	      if (listener_add(optarg) < 0) {
+		  log_msg(LOG_ERR, "%s: Bad listen address \"%s\"\n",
 			  progname, optarg);
 		  exit(-1);
 	      }
+	      /* tcp only listens on the first one */
+	      if (nlisteners == 1)
+		  recv_addr.sin_addr = listeners[0].addr.sin_addr;
 	      break;
 	  }
 	case 'b': {
@@ -473,8 +596,9 @@ int parse_args(int argc, char **argv)
 		break;
 	}
 	  case 't': {
-	    if ((forward_timeout = atoi(optarg)))
-	      log_debug(1, "Setting timeout value to %i seconds.", 
+	    /* fractions of a second are fine */
+	    if ((forward_timeout = (int)(atof(optarg) * 1000)))
+	      log_debug(1, "Setting timeout value to %i ms.", 
 			forward_timeout);
 	    else 
 	      log_debug(1, "Timeout=0. Servers will never timeout.");
@@ -509,6 +633,182 @@ int parse_args(int argc, char **argv)
             exc_port_ofst++;
 	    break;
           }
+	  case OPT_RECV_BATCH: {
+	    recv_batch = atoi(optarg);
+	    if ((recv_batch < 1) || (recv_batch > RECV_BATCH_MAX)) {
+	      log_msg(LOG_ERR, "%s: --recv-batch must be between 1 and %i\n",
+		      progname, RECV_BATCH_MAX);
+	      exit(-1);
+	    }
+	    log_debug(1, "Reading up to %i requests at a time", recv_batch);
+	    break;
+	  }
+	  case OPT_WORKERS: {
+	    workers = atoi(optarg);
+	    if ((workers < 1) || (workers > WORKERS_MAX)) {
+	      log_msg(LOG_ERR, "%s: --workers must be between 1 and %i\n",
+		      progname, WORKERS_MAX);
+	      exit(-1);
+	    }
+	    log_debug(1, "Starting %i workers", workers);
+	    break;
+	  }
+	  case OPT_PIN_WORKERS: {
+	    worker_pin = 1;
+	    break;
+	  }
+	  case OPT_CPU: {
+	    if ((worker_cpu = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --cpu can't be negative\n", progname);
+	      exit(-1);
+	    }
+	    worker_pin = 1;
+	    break;
+	  }
+	  case OPT_ADMIT_QUEUE: {
+	    admit_queue = atoi(optarg);
+	    if ((admit_queue < 0) || (admit_queue > ADMIT_MAX)) {
+	      log_msg(LOG_ERR, "%s: --admit-queue must be between 0 and %i\n",
+		      progname, ADMIT_MAX);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_ADMIT_WAIT: {
+	    if ((admit_wait = atoi(optarg)) < 1) {
+	      log_msg(LOG_ERR, "%s: --admit-wait must be at least 1 ms\n",
+		      progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_ADMIT_POLICY: {
+	    if (strcmp(optarg, "fifo") == 0) admit_policy = ADMIT_FIFO;
+	    else if (strcmp(optarg, "fair") == 0) admit_policy = ADMIT_FAIR;
+	    else {
+	      log_msg(LOG_ERR, "%s: --admit-policy must be fifo or fair\n",
+		      progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_LOOKUP_THREADS: {
+	    lookup_threads = atoi(optarg);
+	    if ((lookup_threads < 0) || (lookup_threads > LOOKUP_MAX)) {
+	      log_msg(LOG_ERR, "%s: --lookup-threads must be between 0 and %i\n",
+		      progname, LOOKUP_MAX);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_COALESCE: {
+	    if ((coalesce_max = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --coalesce can't be negative\n", progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_COALESCE_WAIT: {
+	    if ((coalesce_wait = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --coalesce-wait can't be negative\n",
+		      progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_FORWARD_RETRIES: {
+	    forward_retries = atoi(optarg);
+	    if ((forward_retries < 0) || (forward_retries > 8)) {
+	      log_msg(LOG_ERR, "%s: --forward-retries must be between 0 and 8\n",
+		      progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_FANOUT: {
+	    if (strcmp(optarg, "all") == 0) fanout = FANOUT_ALL;
+	    else if (strcmp(optarg, "hedge") == 0) fanout = FANOUT_HEDGE;
+	    else {
+	      log_msg(LOG_ERR, "%s: --fanout must be all or hedge\n", progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_FANOUT_WIDTH: {
+	    fanout_width = atoi(optarg);
+	    if ((fanout_width < 1) || (fanout_width > FANOUT_MAX)) {
+	      log_msg(LOG_ERR, "%s: --fanout-width must be between 1 and %i\n",
+		      progname, FANOUT_MAX);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_RCVBUF:
+	  case OPT_SNDBUF:
+	  case OPT_UPSTREAM_RCVBUF:
+	  case OPT_UPSTREAM_SNDBUF: {
+	    int size = atoi(optarg);
+	    if (size < 0) {
+	      log_msg(LOG_ERR, "%s: socket buffer sizes can't be negative\n",
+		      progname);
+	      exit(-1);
+	    }
+	    if (c == OPT_RCVBUF) listen_rcvbuf = size;
+	    else if (c == OPT_SNDBUF) listen_sndbuf = size;
+	    else if (c == OPT_UPSTREAM_RCVBUF) upstream_rcvbuf = size;
+	    else upstream_sndbuf = size;
+	    break;
+	  }
+	  case OPT_BUSY_POLL: {
+	    if ((busy_poll = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --busy-poll can't be negative\n", progname);
+	      exit(-1);
+	    }
+	    /* spinning only pays off on a cpu of its own */
+	    if (busy_poll) worker_pin = 1;
+	    log_debug(1, "Busy polling for %i usec", busy_poll);
+	    break;
+	  }
+	  case OPT_SHARED_SOCKETS: {
+	    shared_sockets = atoi(optarg);
+	    if ((shared_sockets < 1) || (shared_sockets > UPSOCK_MAX)) {
+	      log_msg(LOG_ERR, "%s: --shared-sockets must be between 1 and %i\n",
+		      progname, UPSOCK_MAX);
+	      exit(-1);
+	    }
+	    log_debug(1, "Using %i upstream sockets per interface",
+		      shared_sockets);
+	    break;
+	  }
+	  case OPT_SOCKET_POOL: {
+	    upsock_pool = atoi(optarg);
+	    if ((upsock_pool < 0) || (upsock_pool > UPSOCK_MAX)) {
+	      log_msg(LOG_ERR, "%s: --socket-pool must be between 0 and %i\n",
+		      progname, UPSOCK_MAX);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_SOCKET_USES: {
+	    if ((upsock_uses = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --socket-uses can't be negative\n", progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+	  case OPT_SOCKET_AGE: {
+	    if ((upsock_age = atoi(optarg)) < 0) {
+	      log_msg(LOG_ERR, "%s: --socket-age can't be negative\n", progname);
+	      exit(-1);
+	    }
+	    break;
+	  }
+#ifdef ENABLE_IO_URING
+	  case OPT_IO_URING: {
+	    event_use_uring = 1;
+	    break;
+	  }
+#endif
 	  case ':': {
 	      log_msg(LOG_ERR, "%s: Missing parameter for \"%s\"\n",
 		      progname, argv[optind]);
@@ -530,5 +830,14 @@ int parse_args(int argc, char **argv)
 		progname, argv[optind]);
 	exit(-1);
     }
+#ifdef ENABLE_IO_URING
+    /* the io_uring backend receives on every registered fd, it can't
+       wait for the lookup threads' eventfd */
+    if (event_use_uring && lookup_threads) {
+	log_msg(LOG_WARNING, "%s: --io-uring doesn't work with "
+		"--lookup-threads, using epoll\n", progname);
+	event_use_uring = 0;
+    }
+#endif
     return optind;
 }
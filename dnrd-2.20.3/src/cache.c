@@ -25,6 +25,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "dns.h"
@@ -32,6 +33,8 @@
 #include "lib.h"
 #include "dns.h"
 #include "srvnode.h"
+#include "clock.h"
+#include "pkt.h"
 
 	/*
 	 * Cache time calculations are done in seconds.  CACHE_TIMEUNIT
@@ -52,14 +55,6 @@
 #define	CACHE_TIME		(    60 * CACHE_TIMEUNIT)
 #define CACHE_MAXTIME		(6 * 60 * CACHE_TIMEUNIT)
 
-	/*
-	 * The expire function can be called as often as wanted.
-	 * It will however wait CACHE_MINCYCLE between two
-	 * expire runs.
-	 */
-
-#define	CACHE_MINCYCLE		(5 * CACHE_TIMEUNIT)
-
 	/*
 	 * If after an expire the cache holds more than CACHE_HIGHWATER
 	 * items the oldest items are removed until there are only
@@ -80,7 +75,8 @@ typedef struct _cache {
     unsigned long lastused;
     unsigned long expires;
 
-    dnsheader_t	*p;		/* The DNS packet with decoded header */
+    pkt_t	*pkt;		/* The DNS packet, shared with the sender */
+    dnsheader_t	 h;		/* and its decoded header */
 
   srvnode_t *server; /* the server that gave this answer */
     struct _cache *next, *prev;
@@ -95,33 +91,42 @@ long	cache_lowwater		= CACHE_LOWWATER;
 static cache_t *cachelist	= NULL;
 static cache_t *lastcache	= NULL;
 
+	/*
+	 * The lookup threads search the cache while the relay loop
+	 * adds and expires entries.  A hit only touches the expire
+	 * time and the counters, which are updated atomically.
+	 */
+
+static pthread_rwlock_t cache_lock	= PTHREAD_RWLOCK_INITIALIZER;
+
 int cache_hits		  = 0;
 int cache_misses		= 0;
 
 
 static int free_cx(cache_t *cx)
 {
-    free_packet(cx->p);
+    pkt_put(cx->pkt);
     free(cx->name);
     free(cx);
     
     return (0);
 }
 
-static cache_t *create_cx(dnsheader_t *x, rr_t *query, srvnode_t *server)
+static cache_t *create_cx(pkt_t *p, rr_t *query, srvnode_t *server)
 {
     cache_t	*cx;
 
     cx = allocate(sizeof(cache_t));
+    cx->pkt = pkt_ref(p);
+    view_packet(&cx->h, p->data, p->len);
 
     cx->name = strdup(query->name);
     cx->code = get_stringcode(cx->name);
 
-    cx->positive = x->ancount;
+    cx->positive = cx->h.ancount;
     cx->type     = query->type;
     cx->class    = query->class;
-    cx->p        = x;
-    cx->lastused = time(NULL);
+    cx->lastused = clock_now;
     cx->server = server;
 
     return (cx);
@@ -139,9 +144,9 @@ static cache_t *append_cx(cache_t *cx)
 	lastcache = cx;
     }
 
-    cx->created = time(NULL);
+    cx->created = clock_now;
     log_debug(3, "cache: added %s, type= %d, class: %d, ans= %d\n",
-	      cx->name, cx->type, cx->class, cx->p->ancount);
+	      cx->name, cx->type, cx->class, cx->h.ancount);
 
     return (cx);
 }
@@ -168,47 +173,65 @@ static cache_t *remove_cx(cache_t *cx)
 
 
 /*
- * cache_dnspacket()
+ * cache_pkt()
  *
- * In:      packet - the response packet to cache.
- *          len    - length of the response packet.
+ * In:      p      - the response packet to cache.
  *
  * Returns: 0, all the time.
  *
  * Take the response packet and look if it meets some basic
- * conditions for caching.  If so put the entire response into
- * our cache.
+ * conditions for caching.  If so keep a reference to the entire
+ * response in our cache.  The packet must not be changed after this.
  */
-int cache_dnspacket(void *packet, int len, srvnode_t *server)
+int cache_pkt(pkt_t *p, srvnode_t *server)
 {
-    dnsheader_t *x;
     rr_t	query;
     cache_t	*cx = NULL;
 
     if ((cache_onoff == 0) ||
-	parse_query(&query, packet, len) ||
+	parse_query(&query, (unsigned char *)p->data, p->len) ||
 	(GET_QR(query.flags) == 0) ||
 	(*query.name == 0)) {
 	return (0);
     }
 
-    x = parse_packet(packet, len);
-
     /*
      * Ok, the packet is interesting for us.  Let's put it into our
      * cache list.
      */
-    sem_wait(&dnrd_sem);
-    cx = create_cx(x, &query, server);
+    pthread_rwlock_wrlock(&cache_lock);
+    cx = create_cx(p, &query, server);
     append_cx(cx);
 
     /*
      * Set the expire time of the cached object.
      */
-    cx->lastused = time(NULL);
+    cx->lastused = clock_now;
     cx->expires  = cx->lastused +
-	           ((cx->p->ancount > 0) ? CACHE_TIME : CACHE_NEGTIME);
-    sem_post(&dnrd_sem);
+	           ((cx->h.ancount > 0) ? CACHE_TIME : CACHE_NEGTIME);
+    pthread_rwlock_unlock(&cache_lock);
+    return (0);
+}
+
+/*
+ * cache_dnspacket()
+ *
+ * Like cache_pkt() for a packet that is not in a buffer of its own
+ * yet.  Used by the tcp threads.
+ */
+int cache_dnspacket(void *packet, int len, srvnode_t *server)
+{
+    pkt_t	*p;
+
+    if (cache_onoff == 0 || len > UDP_MAXSIZE) return (0);
+
+    p = pkt_alloc();
+    memcpy(p->data, packet, len);
+    p->len = len;
+    cache_pkt(p, server);
+    /* not cached, don't hand it to the pool from this thread */
+    if (p->refs == 1) free(p);
+    else pkt_put(p);
     return (0);
 }
 
@@ -250,34 +273,40 @@ int cache_lookup(void *packet, int len)
      * ... and search our cache for this request.
      */
     code = get_stringcode(query.name);
+    pthread_rwlock_rdlock(&cache_lock);
     for (cx = cachelist; cx != NULL; cx = cx->next) {
       if (cx->code == code  &&
 	  cx->type == query.type  &&
 	  cx->class == query.class  &&
 	  strcasecmp(cx->name, query.name) == 0) {
+	int n = cx->h.len;
 	
 	log_debug(3, "cache: found %s, type= %d, class: %d, ans= %d\n",
-		  cx->name, cx->type, cx->class, cx->p->ancount);
+		  cx->name, cx->type, cx->class, cx->h.ancount);
 
 	if (cx->positive > 0) {
-	  cx->lastused = time(NULL);
-	  cx->expires  = cx->lastused + CACHE_TIME;
+	  __atomic_store_n(&cx->lastused, clock_now, __ATOMIC_RELAXED);
+	  __atomic_store_n(&cx->expires, clock_now + CACHE_TIME,
+			   __ATOMIC_RELAXED);
 	}
 
-	memcpy(packet + 2, cx->p->packet + 2, cx->p->len - 2);
-	cache_hits++;
+	memcpy(packet + 2, cx->h.packet + 2, n - 2);
+	__atomic_fetch_add(&cache_hits, 1, __ATOMIC_RELAXED);
 
 	/* lets check if the server is active */
 	if (ignore_inactive_cache_hits && cx->server->inactive ) {
+	  pthread_rwlock_unlock(&cache_lock);
 	  log_debug(2, "server is inactive. Skipping cache entry");
 	  return (0);
 	}
 
-	return (cx->p->len);
+	pthread_rwlock_unlock(&cache_lock);
+	return (n);
       }
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-    cache_misses++;
+    __atomic_fetch_add(&cache_misses, 1, __ATOMIC_RELAXED);
     return (0);
 }
 
@@ -351,19 +380,15 @@ int cache_expire(void)
     int	           total, expired;
     time_t         now;
     cache_t	  *cx, *next;
-    static time_t  lastexpire = 0;
 
     if (cache_onoff == 0) return (0);
 
-    /* Initialize lastexpire to the current time */
-    if (lastexpire == 0) lastexpire = time(NULL);
-
-    now = time(NULL);
-    if (now - lastexpire < CACHE_MINCYCLE) return (0);
+    now = clock_now;
 
     total = 0;
     expired = 0;
 
+    pthread_rwlock_wrlock(&cache_lock);
     cx = cachelist;
     while (cx != NULL) {
 	total += 1;
@@ -390,12 +415,19 @@ int cache_expire(void)
     if (total > cache_highwater) {
 	expire_oldest(total);
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-    lastexpire = now;
     return (0);
 }
 
 
+/* is the cache empty? */
+int cache_empty(void)
+{
+    return (cachelist == NULL);
+}
+
+
 /*
  * cache_init()
  *
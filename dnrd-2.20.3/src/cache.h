@@ -23,14 +23,25 @@
 #ifndef _DNRD_CACHE_H_
 #define	_DNRD_CACHE_H_
 
+#include "pkt.h"
+
+	/*
+	 * The relay loop runs the expire function every
+	 * CACHE_MINCYCLE seconds (5 minutes).
+	 */
+
+#define	CACHE_MINCYCLE		(5 * 60)
+
 extern char cache_param[256];
 extern int cache_hits;
 extern int cache_misses;
 
 /* Interface for DNS cache */
+int cache_pkt(pkt_t *p, srvnode_t *server);
 int cache_dnspacket(void *packet, int len, srvnode_t *server);
 int cache_lookup(void *packet, int len);
 int cache_expire(void);
+int cache_empty(void);
 int cache_init(void);
 
 #endif /* _DNRD_CACHE_H_ */
@@ -0,0 +1,83 @@
+/*
+ * clock.c - the time as seen by the relay loop
+ *
+ * Everything that happens during one round of the relay loop sees the
+ * same time, so the clock is read once per round instead of for every
+ * packet. CLOCK_MONOTONIC_COARSE is used where it exists; it is cheap
+ * to read and has a few milliseconds of resolution, which is plenty for
+ * timeouts and round trip times.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "clock.h"
+
+msec_t clock_ms = 0;
+time_t clock_now = 0;
+
+/* added to the monotonic clock to make it start at the wall clock */
+static msec_t offset = 0;
+static int    initialized = 0;
+
+static msec_t read_clock(void) {
+#if defined(CLOCK_MONOTONIC_COARSE)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return MSEC(ts.tv_sec) + ts.tv_nsec / 1000000;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return MSEC(ts.tv_sec) + ts.tv_nsec / 1000000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return MSEC(tv.tv_sec) + tv.tv_usec / 1000;
+#endif
+}
+
+long long clock_usec(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+void clock_update(void) {
+  msec_t ms = read_clock();
+
+  if (!initialized) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    offset = MSEC(tv.tv_sec) + tv.tv_usec / 1000 - ms;
+    initialized = 1;
+  }
+  ms += offset;
+
+  /* the fallback clock could go back */
+  if (ms > clock_ms) clock_ms = ms;
+  clock_now = clock_ms / 1000;
+}
@@ -0,0 +1,41 @@
+/*
+ * clock.h - the time as seen by the relay loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_CLOCK_H_
+#define _DNRD_CLOCK_H_
+
+#include <time.h>
+
+/* a time or interval in milliseconds */
+typedef long long msec_t;
+
+#define MSEC(secs) ((msec_t)(secs) * 1000)
+
+/* The time when the current round of the relay loop started, from a
+ * monotonic clock. It starts out at the wall clock time of the startup,
+ * so it reads like time(NULL), but it never jumps. */
+extern msec_t clock_ms;
+extern time_t clock_now; /* the same in seconds */
+
+/* sample the clock. Called once per round of the relay loop */
+void clock_update(void);
+
+/* read the precise monotonic clock in usec, for short intervals */
+long long clock_usec(void);
+
+#endif /* _DNRD_CLOCK_H_ */
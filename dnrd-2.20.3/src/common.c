@@ -72,7 +72,10 @@ int                 isock = -1;
 int                 tcpsock = -1;
 #endif
 int                 select_timeout = SELECT_TIMEOUT;
-int                 forward_timeout = FORWARD_TIMEOUT;
+int                 forward_timeout = FORWARD_TIMEOUT * 1000;
+int                 forward_retries = FORWARD_RETRIES;
+int                 fanout = FANOUT_ALL;
+int                 fanout_width = FANOUT_WIDTH;
 //int                 load_balance = 0;
 #ifndef __CYGWIN__
 uid_t               daemonuid = 0;
@@ -98,15 +101,12 @@ infnode_t           *inf_list;
 /* turn this on to skip cache hits from responses of inactive dns servers */
 int                 ignore_inactive_cache_hits = 0; 
 
-/* highest socket number */
-int                 maxsock;
-
 /* maximum number of open sockets. If we have this amount of
    concurrent queries, we start dropping new ones */
 int max_sockets = 200;
 
-/* the fd set. query modifies this so we make it global */
-fd_set              fdmaster;
+/* number of requests read from isock at a time */
+int recv_batch = RECV_BATCH;
 
 
 
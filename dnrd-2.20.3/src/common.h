@@ -52,23 +52,65 @@
  * response from a DNS server within forward_timeout, deactivate the
  * server.  note that if select_timeout is greater than this, the
  * forward timeout *might* increase to select_timeout. This value
- * should be >= SELECT_TIMEOUT
+ * should be >= SELECT_TIMEOUT. It is in seconds here, forward_timeout
+ * itself is kept in milliseconds.
  */
 /* 12 seems to be a good value under heavy load... */
 #ifndef FORWARD_TIMEOUT
 #define FORWARD_TIMEOUT 12
 #endif
 
-/* not used yet */
+/* times a query is sent again to a server that hasn't replied yet,
+ * before it times out. The first retry waits one retransmission
+ * timeout (RTO) of the server, every further one twice as long as the
+ * one before it. The RTO is its smoothed rtt plus four times the mean
+ * deviation (RFC 6298), at least RTO_MIN ms and RTO_INIT ms as long
+ * as nothing has been heard from it. */
 #ifndef FORWARD_RETRIES
 #define FORWARD_RETRIES 5
 #endif
+#ifndef RTO_MIN
+#define RTO_MIN 50
+#endif
+#ifndef RTO_INIT
+#define RTO_INIT 1000
+#endif
+
+/* how a query is sent through the interfaces. FANOUT_ALL sends it
+ * through all of them at once. FANOUT_HEDGE sends it through the one
+ * whose server has the lowest smoothed rtt, and through the next one
+ * when it hasn't answered within about the 90th percentile of its rtt,
+ * srtt plus twice the mean deviation but at least HEDGE_MIN ms. */
+#define FANOUT_ALL   0
+#define FANOUT_HEDGE 1
+
+/* the number of interfaces a query is sent through at most, 1 to
+ * FANOUT_MAX. It is cut down to the number of interfaces at startup,
+ * and every query keeps a socket and a few words per path. */
+#ifndef FANOUT_WIDTH
+#define FANOUT_WIDTH 3
+#endif
+#define FANOUT_MAX 8 /* the legs of a query are kept in 8 bit masks */
+#ifndef HEDGE_MIN
+#define HEDGE_MIN 10
+#endif
 
 /* only check if any server are to be reactivated every
  * REACTIVATE_INTERVAL seconds
  */
 #define REACTIVATE_INTERVAL 10
 
+/* Number of client requests read from the listening socket with one
+ * recvmmsg() call. RECV_BATCH is the default, RECV_BATCH_MAX the
+ * upper limit for --recv-batch.
+ */
+#ifndef RECV_BATCH
+#define RECV_BATCH 32
+#endif
+#ifndef RECV_BATCH_MAX
+#define RECV_BATCH_MAX 64
+#endif
+
 struct dnssrv_t {
   int                    sock;      /* for communication with server */
   struct sockaddr_in     addr;      /* IP address of server */
@@ -85,7 +127,10 @@ extern const char*         pid_file; /* File containing current daemon's PID */
 extern int                 isock;     /* for communication with clients */
 extern int                 tcpsock;   /* same as isock, but for tcp requests */
 extern int                 select_timeout; /* select timeout in seconds */
-extern int                 forward_timeout; /* timeout for forward DNS */
+extern int                 forward_timeout; /* timeout for forward DNS, ms */
+extern int                 forward_retries; /* retransmissions per query */
+extern int                 fanout; /* FANOUT_ALL or FANOUT_HEDGE */
+extern int                 fanout_width; /* paths per query at most */
 extern struct sockaddr_in  recv_addr; /* address on which we receive queries */
 #ifndef __CYGWIN__
 extern uid_t               daemonuid; /* to switch to once daemonised */
@@ -125,8 +170,7 @@ extern special_hosts_t sp_hosts[30];
 extern int sp_hosts_count;
 
 extern int max_sockets;
-extern int maxsock;
-extern fd_set fdmaster;
+extern int recv_batch;
 
 /* kill any currently running copies of dnrd */
 int kill_current();
@@ -76,13 +76,10 @@ static dnsheader_t *alloc_packet(void *packet, int len)
     return (x);
 }
 
-static dnsheader_t *decode_header(void *packet, int len)
+/* fill in the decoded header fields of x from x->packet */
+static void read_header(dnsheader_t *x)
 {
-    unsigned short int *p;
-    dnsheader_t *x;
-
-    x = alloc_packet(packet, len);
-    p = (unsigned short int *) x->packet;
+    unsigned short int *p = (unsigned short int *) x->packet;
 
     x->id      = ntohs(p[0]);
     x->u       = ntohs(p[1]);
@@ -92,9 +89,27 @@ static dnsheader_t *decode_header(void *packet, int len)
     x->arcount = ntohs(p[5]);
 
 		x->here    = (char *) &x->packet[12];
+}
+
+static dnsheader_t *decode_header(void *packet, int len)
+{
+    dnsheader_t *x;
+
+    x = alloc_packet(packet, len);
+    read_header(x);
     return (x);
 }
 
+/* decode the header of packet into x. The packet is not copied, so it
+   must live as long as x is used */
+void view_packet(dnsheader_t *x, char *packet, int len)
+{
+    memset(x, 0, sizeof(dnsheader_t));
+    x->packet = packet;
+    x->len    = len;
+    read_header(x);
+}
+
 static int raw_dump(dnsheader_t *x)
 {
     unsigned int c;
@@ -275,16 +290,10 @@ static int read_record(dnsheader_t *x, rr_t *y,
 
 int check_replycode(unsigned char *packet, int len)
 {
-  int	rcode;
-  dnsheader_t *x;
+  if (len < 12) return (-1);
 
-  if ((x = decode_header(packet, len)) == NULL ) {
-    return (-1);
-  }
-
-  rcode = GET_RCODE(x->u); // only 0 is a valid response.
-  free_packet(x);
-  return rcode;
+  /* only 0 is a valid response. The flags are read in place */
+  return GET_RCODE(ntohs(((unsigned short int *)packet)[1]));
 }
 
 int dump_dnspacket(char *type, unsigned char *packet, int len)
@@ -105,6 +105,7 @@ int free_packet(dnsheader_t *x);
 
 void init_dns(void);
 dnsheader_t *parse_packet(unsigned char *packet, int len);
+void view_packet(dnsheader_t *x, char *packet, int len);
 int parse_query(rr_t *query, unsigned char *msg, int len);
 int snprintf_cname(char *msg, const int msgsize, /* the dns packet */
 									 int index, /* where in the DNS packet the name is */
@@ -0,0 +1,243 @@
+/*
+ * event.c - socket readiness notification for the relay loop
+ *
+ * Every socket the relay loop waits on is registered together with a
+ * pointer back to its owner, so that a ready socket can be dispatched
+ * directly.  On Linux this uses an edge triggered epoll set and the
+ * cost of a wakeup only depends on the number of ready sockets.  Where
+ * epoll is missing we fall back to the old pselect() loop. With
+ * --io-uring the work is handed to uring.c instead.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/time.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
+#endif
+
+#include "common.h"
+#include "lib.h"
+#include "event.h"
+#ifdef ENABLE_IO_URING
+#include "uring.h"
+#endif
+
+int event_use_uring = 0;
+#ifdef ENABLE_IO_URING
+static int uring_on = 0; /* the io_uring backend is in use */
+#endif
+
+/* the events returned by the last event_wait(). event_del() clears
+   entries in here so the caller never dispatches a destroyed owner */
+static event_t **cur_ready = NULL;
+static int cur_nready = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static int epfd = -1;
+
+static int backend_init(void) {
+  if ((epfd = epoll_create(EVENT_MAXREADY)) < 0) {
+    log_msg(LOG_ERR, "epoll_create: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int backend_add(event_t *ev) {
+  struct epoll_event ee;
+
+  memset(&ee, 0, sizeof(ee));
+  ee.events = ev->type == EV_SENDQ ? EPOLLOUT : EPOLLIN;
+  /* the tcp listener accepts one connection per wakeup */
+  if (ev->type != EV_TCP) ee.events |= EPOLLET;
+  ee.data.ptr = ev;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev->fd, &ee) < 0) {
+    log_msg(LOG_ERR, "epoll_ctl: fd %i: %s", ev->fd, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void backend_del(event_t *ev) {
+  struct epoll_event ee; /* needed by kernels before 2.6.9 */
+  epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, &ee);
+}
+
+static int backend_wait(event_t **ready, int max,
+			const struct timespec *tout, const sigset_t *sigmask) {
+  struct epoll_event evs[EVENT_MAXREADY];
+  int ms = -1;
+  int i, n;
+
+  if (tout != NULL)
+    ms = tout->tv_sec * 1000 + (tout->tv_nsec + 999999) / 1000000;
+
+  if ((n = epoll_pwait(epfd, evs, max, ms, sigmask)) <= 0)
+    return n;
+
+  for (i = 0; i < n; i++)
+    ready[i] = (event_t *)evs[i].data.ptr;
+  return n;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+static fd_set   fdmaster;        /* all sockets registered for reading */
+static fd_set   fdwmaster;       /* and for writing */
+static int      maxsock = -1;    /* highest registered socket */
+static event_t *fdtab[FD_SETSIZE]; /* socket -> event */
+
+static int backend_init(void) {
+  FD_ZERO(&fdmaster);
+  FD_ZERO(&fdwmaster);
+  memset(fdtab, 0, sizeof(fdtab));
+  return 0;
+}
+
+static int backend_add(event_t *ev) {
+  if (ev->fd >= FD_SETSIZE) {
+    log_msg(LOG_ERR, "socket %i is above FD_SETSIZE", ev->fd);
+    return -1;
+  }
+  FD_SET(ev->fd, ev->type == EV_SENDQ ? &fdwmaster : &fdmaster);
+  fdtab[ev->fd] = ev;
+  if (ev->fd > maxsock) maxsock = ev->fd;
+  return 0;
+}
+
+static void backend_del(event_t *ev) {
+  if (ev->fd < 0 || ev->fd >= FD_SETSIZE) return;
+  FD_CLR(ev->fd, &fdmaster);
+  FD_CLR(ev->fd, &fdwmaster);
+  fdtab[ev->fd] = NULL;
+}
+
+static int backend_wait(event_t **ready, int max,
+			const struct timespec *tout, const sigset_t *sigmask) {
+  fd_set fdread = fdmaster, fdwrite = fdwmaster;
+  int fd, n, retn;
+
+  if ((retn = pselect(maxsock+1, &fdread, &fdwrite, 0, tout, sigmask)) <= 0)
+    return retn;
+
+  for (fd = 0, n = 0; fd <= maxsock && n < max && n < retn; fd++) {
+    if ((FD_ISSET(fd, &fdread) || FD_ISSET(fd, &fdwrite)) && fdtab[fd] != NULL)
+      ready[n++] = fdtab[fd];
+  }
+  return n;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+int event_init(void) {
+#ifdef ENABLE_IO_URING
+  if (event_use_uring) {
+    if (uring_init() == 0) {
+      uring_on = 1;
+      return 0;
+    }
+    log_msg(LOG_WARNING, "io_uring is not available, falling back to "
+#ifdef HAVE_SYS_EPOLL_H
+	    "epoll"
+#else
+	    "pselect"
+#endif
+	    );
+  }
+#endif
+  return backend_init();
+}
+
+int event_add(event_t *ev, int fd, int type, void *owner, int idx) {
+  ev->fd = fd;
+  ev->type = type;
+  ev->owner = owner;
+  ev->idx = idx;
+#ifdef ENABLE_IO_URING
+  if (uring_on) return uring_add(ev, fd, type, owner, idx);
+#endif
+  return backend_add(ev);
+}
+
+int event_wait(event_t **ready, int max, const struct timespec *tout,
+	       const sigset_t *sigmask) {
+  int n;
+
+  if (max > EVENT_MAXREADY) max = EVENT_MAXREADY;
+  cur_nready = 0;
+#ifdef ENABLE_IO_URING
+  if (uring_on) n = uring_wait(ready, max, tout, sigmask);
+  else
+#endif
+  n = backend_wait(ready, max, tout, sigmask);
+  if (n > 0) {
+    cur_ready = ready;
+    cur_nready = n;
+  }
+  return n;
+}
+
+void event_del(event_t *ev) {
+  int i;
+#ifdef ENABLE_IO_URING
+  if (uring_on) uring_del(ev);
+  else
+#endif
+  backend_del(ev);
+  /* forget it if it is still waiting to be dispatched */
+  for (i = 0; i < cur_nready; i++)
+    if (cur_ready[i] == ev) cur_ready[i] = NULL;
+}
+
+int event_recvmsg(int fd, struct msghdr *mh) {
+#ifdef ENABLE_IO_URING
+  if (uring_on) return uring_recvmsg(fd, mh);
+#endif
+  return recvmsg(fd, mh, 0);
+}
+
+#ifdef HAVE_RECVMMSG
+int event_recvmmsg(int fd, struct mmsghdr *vec, unsigned int n) {
+#ifdef ENABLE_IO_URING
+  if (uring_on) {
+    int i, rc;
+    for (i = 0; i < (int)n; i++) {
+      if ((rc = uring_recvmsg(fd, &vec[i].msg_hdr)) < 0) break;
+      vec[i].msg_len = rc;
+    }
+    return i ? i : -1;
+  }
+#endif
+  return recvmmsg(fd, vec, n, 0, NULL);
+}
+#endif
+
+int event_sendmsg(int fd, struct msghdr *mh, int slot) {
+#ifdef ENABLE_IO_URING
+  if (uring_on) return uring_sendmsg(fd, mh, slot);
+#endif
+  return -1;
+}
@@ -0,0 +1,82 @@
+/*
+ * event.h - socket readiness notification for the relay loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_EVENT_H_
+#define _DNRD_EVENT_H_
+
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* what kind of object a registered socket belongs to */
+#define EV_LISTEN  1 /* a udp listener (listener_t) */
+#define EV_TCP     2 /* the tcp listener (tcpsock) */
+#define EV_QUERY   3 /* an upstream socket owned by a query_t */
+#define EV_UPSTREAM 4 /* a shared upstream socket (upsock_t) */
+#define EV_LOOKUP  5 /* the lookup threads' eventfd */
+#define EV_SENDQ   6 /* a full socket the send queue waits to write to */
+
+/* A registered socket. The event is embedded in its owner, so a ready
+ * socket leads straight back to the listener or query it belongs to
+ * without searching for it. */
+typedef struct _event {
+  int   fd;
+  int   type;   /* one of EV_* */
+  void *owner;  /* the query_t, upsock_t or listener_t, NULL for tcp
+		   and the lookup threads */
+  int   idx;    /* socket index within the owner */
+} event_t;
+
+/* max number of ready events returned by one event_wait() */
+#define EVENT_MAXREADY 64
+
+/* use the io_uring backend if the kernel has it (--io-uring) */
+extern int event_use_uring;
+
+/* set up the event backend. Returns -1 on failure */
+int event_init(void);
+
+/* register fd. Edge triggered where the backend supports it, so the
+ * owner must read until EAGAIN. EV_SENDQ sockets are waited on for
+ * writing instead. Returns -1 on failure. */
+int event_add(event_t *ev, int fd, int type, void *owner, int idx);
+
+/* unregister; must be called before the socket is closed */
+void event_del(event_t *ev);
+
+/* Wait for ready sockets, atomically installing sigmask while waiting.
+ * tout == NULL means wait forever.  Returns the number of ready
+ * events stored in ready[], 0 on timeout, -1 on error (errno set) */
+int event_wait(event_t **ready, int max, const struct timespec *tout,
+	       const sigset_t *sigmask);
+
+/* Read from a registered socket. These behave like recvmsg() and
+ * recvmmsg() on a non-blocking socket. With the io_uring backend the
+ * packets have already been received and are only copied out. */
+int event_recvmsg(int fd, struct msghdr *mh);
+#ifdef HAVE_RECVMMSG
+struct mmsghdr;
+int event_recvmmsg(int fd, struct mmsghdr *vec, unsigned int n);
+#endif
+
+/* Let the backend send mh later, without a system call of its own.
+ * sendq_done(slot) is called with the result. Returns -1 if the
+ * backend can't do that and the caller has to send it itself. */
+int event_sendmsg(int fd, struct msghdr *mh, int slot);
+
+#endif  /* _DNRD_EVENT_H_ */
@@ -40,6 +40,8 @@
 #include "common.h"
 #include "udp.h"
 #include "infnode.h"
+#include "clock.h"
+#include "relay.h"
 
 /* Allocate an interface node */
 infnode_t *alloc_infnode(void) {
@@ -178,7 +180,8 @@ srvnode_t *next_active(infnode_t *i) {
 srvnode_t *deactivate_current(infnode_t *i) {
   assert(i!=NULL);
   if (i->current) {
-    i->current->inactive = time(NULL);
+    i->current->inactive = clock_now;
+    retry_servers();
     log_msg(LOG_NOTICE, "Deactivating DNS server %s",
 	      inet_ntoa(i->current->addr.sin_addr));
   }
@@ -186,6 +189,34 @@ srvnode_t *deactivate_current(infnode_t *i) {
 }
 
 
+/* the bit for s in a mask of the servers of i, by its place in the
+   list. The servers past the 32nd share the last bit */
+unsigned int server_bit(infnode_t *i, srvnode_t *s) {
+  srvnode_t *n;
+  int b = 0;
+
+  for (n = i->srvlist->next; n != s && n != i->srvlist; n = n->next)
+    if (b < 31) b++;
+  return 1u << b;
+}
+
+/* the server of i with its bit in mask that from is the address of,
+   NULL if there is none */
+srvnode_t *server_in_mask(infnode_t *i, unsigned int mask,
+			  const struct sockaddr_in *from) {
+  srvnode_t *n;
+  int b = 0;
+
+  for (n = i->srvlist->next; n != i->srvlist; n = n->next) {
+    if ((mask & (1u << b))
+	&& n->addr.sin_addr.s_addr == from->sin_addr.s_addr
+	&& n->addr.sin_port == from->sin_port)
+      return n;
+    if (b < 31) b++;
+  }
+  return NULL;
+}
+
 /* reactivate all dns servers */
 void reactivate_srvlist(infnode_t *i) {
   srvnode_t *s;
@@ -199,14 +230,14 @@ void reactivate_srvlist(infnode_t *i) {
 
 /* reactivate servers that have been inactive for delay seconds */
 void retry_srvlist(infnode_t *i, const int delay) {
-  time_t now = time(NULL);
+  time_t now = clock_now;
   srvnode_t *s;
   assert(i!=NULL); /* should never happen */
   s = i->srvlist;
   while ((s = s->next) && (s != i->srvlist))
     if (s->inactive && (now - s->inactive) >= delay ) {
       s->inactive=now;
-      udp_send_dummy(s);
+      udp_send_dummy(i, s);
     }
 }
 
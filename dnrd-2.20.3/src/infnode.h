@@ -33,6 +33,11 @@ typedef struct _infnode {
   srvnode_t       *current;
   int             roundrobin; /* load balance the servers */
   int             retrydelay; /* delay before reactivating the servers */
+  struct _upsock  **upsock;  /* shared upstream sockets (--shared-sockets) */
+  int             nupsock;
+  int             upsock_next; /* next one to send through */
+  struct _upsock  *upspare; /* bound sockets waiting to replace them */
+  int             nupspare;
   struct _infnode *next;    /* ptr to next server */
 } infnode_t;
 
@@ -46,6 +51,9 @@ infnode_t *add_interface(infnode_t *list, char *name, const int maxlen);
 srvnode_t *set_current(infnode_t *i, srvnode_t *s);
 srvnode_t *next_active(infnode_t *i);
 srvnode_t *deactivate_current(infnode_t *i);
+unsigned int server_bit(infnode_t *i, srvnode_t *s);
+srvnode_t *server_in_mask(infnode_t *i, unsigned int mask,
+			  const struct sockaddr_in *from);
 
 infnode_t *ins_infnode (infnode_t *list, infnode_t *p);
 infnode_t *del_infnode(infnode_t *list);
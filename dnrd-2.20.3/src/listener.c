@@ -0,0 +1,140 @@
+/*
+ * listener.c - the udp sockets clients send their queries to
+ *
+ * Every -a option adds a listener with a socket of its own (one per
+ * worker), bound to the address and optionally to an interface. A
+ * query remembers the listener it came in on and the reply goes out
+ * through the same socket, so it comes from the address the client
+ * asked. All listeners share the cache, the query list and the qids.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "common.h"
+#include "lib.h"
+#include "udp.h"
+#include "relay.h"
+#include "listener.h"
+
+listener_t listeners[LISTENER_MAX];
+int        nlisteners = 0;
+
+int listener_add(const char *arg) {
+  listener_t *l;
+  char addr[64];
+  const char *p;
+  int n;
+
+  if (nlisteners == LISTENER_MAX) return -1;
+  l = &listeners[nlisteners];
+  memset(l, 0, sizeof(listener_t));
+  l->addr.sin_family = AF_INET;
+  l->addr.sin_addr.s_addr = INADDR_ANY;
+
+  if ((p = strchr(arg, ':')) != NULL) {
+    if (p[1] == 0 || strlen(p + 1) >= sizeof(l->inf)) return -1;
+    strcpy(l->inf, p + 1);
+    n = p - arg;
+  } else n = strlen(arg);
+  if (n >= (int)sizeof(addr)) return -1;
+  memcpy(addr, arg, n);
+  addr[n] = 0;
+  if (n > 0 && !inet_aton(addr, &l->addr.sin_addr)) return -1;
+
+  nlisteners++;
+  return 0;
+}
+
+static int open_one(listener_t *l) {
+  int sock, opt = 1;
+
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    log_err_exit(-1, "isock: Couldn't open socket");
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+  /* let the kernel spread the clients over the workers */
+  if ((workers > 1) &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    log_err_exit(-1, "isock: Couldn't set SO_REUSEPORT");
+#else
+  if (workers > 1)
+    log_err_exit(-1, "--workers needs SO_REUSEPORT");
+#endif
+
+  /* before the bind, so several interfaces can share an address */
+  if (l->inf[0] && bind_sock2inf(sock, l->inf) < 0)
+    log_err_exit(-1, "isock: Couldn't bind to interface %s", l->inf);
+  if (bind(sock, (struct sockaddr *)&l->addr, sizeof(l->addr)) < 0)
+    log_err_exit(-1, "isock: Couldn't bind local address %s",
+		 inet_ntoa(l->addr.sin_addr));
+
+  udp_sock_setup(sock, listen_rcvbuf, listen_sndbuf);
+  /* the event loop drains the listener until it would block */
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  busy_poll_sock(sock);
+  return sock;
+}
+
+void listener_open(unsigned short port) {
+  listener_t *l;
+  int i;
+
+  if (nlisteners == 0) {
+    listener_add("");
+    listeners[0].addr.sin_addr = recv_addr.sin_addr;
+  }
+
+  for (l = listeners; l < listeners + nlisteners; l++) {
+    l->addr.sin_port = port;
+    for (i = 0; i < workers; i++)
+      l->sock[i] = open_one(l);
+    l->fd = l->sock[0];
+    log_debug(1, "listening on %s%s%s", inet_ntoa(l->addr.sin_addr),
+	      l->inf[0] ? " on " : "", l->inf);
+  }
+  isock = listeners[0].fd;
+}
+
+void listener_keep(int worker) {
+  listener_t *l;
+  int i;
+
+  for (l = listeners; l < listeners + nlisteners; l++) {
+    for (i = 0; i < workers; i++)
+      if (i != worker) close(l->sock[i]);
+    l->fd = l->sock[worker];
+  }
+  isock = listeners[0].fd;
+}
+
+void listener_register(void) {
+  listener_t *l;
+
+  for (l = listeners; l < listeners + nlisteners; l++)
+    if (event_add(&l->ev, l->fd, EV_LISTEN, l, 0) < 0)
+      log_err_exit(-1, "isock: Couldn't add to the event loop");
+}
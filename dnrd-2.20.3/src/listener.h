@@ -0,0 +1,59 @@
+/*
+ * listener.h - the udp sockets clients send their queries to
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_LISTENER_H_
+#define _DNRD_LISTENER_H_
+
+#include <netinet/in.h>
+#include <net/if.h>
+#include "event.h"
+#include "worker.h"
+
+/* upper limit for the number of -a options */
+#ifndef LISTENER_MAX
+#define LISTENER_MAX 16
+#endif
+
+typedef struct _listener {
+  struct sockaddr_in addr;
+  char               inf[IFNAMSIZ]; /* bound to this device, if set */
+  int                sock[WORKERS_MAX]; /* one per worker */
+  int                fd;  /* the one of this worker */
+  unsigned int       drops; /* the kernel's drop count, as last seen */
+  event_t            ev;
+} listener_t;
+
+extern listener_t listeners[LISTENER_MAX];
+extern int        nlisteners;
+
+/* add a listener for "ADDR[:INTERFACE]", as given to -a. An empty
+   ADDR means all local addresses. Returns -1 if it can't be parsed */
+int listener_add(const char *arg);
+
+/* open the sockets of every listener for every worker on port. With
+   no -a there is one listener on all addresses. Call before we give up
+   root */
+void listener_open(unsigned short port);
+
+/* close the sockets that belong to the other workers */
+void listener_keep(int worker);
+
+/* add this worker's sockets to the event loop */
+void listener_register(void);
+
+#endif /* _DNRD_LISTENER_H_ */
@@ -0,0 +1,221 @@
+/*
+ * lookup.c - threads that answer requests from the master database
+ *            and the cache
+ *
+ * With --lookup-threads=N the relay loop only receives and sends. Each
+ * request it reads is copied into an item and handed to one of N
+ * threads, round robin, through a ring of its own. The thread checks
+ * it and looks it up in the master database and the cache, then hands
+ * it back through a second ring. The relay loop is woken by an
+ * eventfd and sends the reply, or forwards the request; the queries,
+ * the servers and the sockets stay with the relay loop alone.
+ *
+ * Every ring has one writer and one reader, so they need no locks.
+ * A thread has at most LOOKUP_RING requests at once, so neither of its
+ * rings can fill up. When all threads have that many the relay loop
+ * does the lookup itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "lib.h"
+#include "check.h"
+#include "udp.h"
+#include "event.h"
+#include "lookup.h"
+
+/* a thread wakes the relay loop after this many requests, and when
+   it runs out of work */
+#define LOOKUP_BATCH 16
+
+typedef struct _lookup_item {
+  struct _lookup_item *next;  /* on the free list */
+  int                  sock;  /* the listener it came in on */
+  struct sockaddr_in   from;
+  int                  len;
+  int                  verdict; /* what udp_classify() said */
+  char                 msg[UDP_MAXSIZE+4];
+} lookup_item_t;
+
+/* a single producer, single consumer ring. head and tail only grow,
+   and each is written by one side only */
+typedef struct {
+  lookup_item_t *slot[LOOKUP_RING];
+  unsigned       head __attribute__((aligned(64))); /* next to take */
+  unsigned       tail __attribute__((aligned(64))); /* next to fill */
+} ring_t;
+
+typedef struct {
+  ring_t    in;       /* requests to look up */
+  ring_t    out;      /* and those done */
+  sem_t     work;     /* posted once for every request in in */
+  pthread_t tid;
+  int       inflight; /* requests in in and out. Relay loop only */
+} lookup_thread_t;
+
+int lookup_threads = 0;
+unsigned long lookup_handed = 0, lookup_inline = 0, lookup_wakeups = 0;
+
+static lookup_thread_t *threads = NULL;
+static int next_thread = 0;
+static lookup_item_t *free_items = NULL;
+static int wakefd = -1;
+static event_t ev_wake;
+
+static void ring_push(ring_t *r, lookup_item_t *it) {
+  unsigned t = r->tail;
+
+  r->slot[t & (LOOKUP_RING - 1)] = it;
+  __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+}
+
+static lookup_item_t *ring_pop(ring_t *r) {
+  unsigned h = r->head;
+  lookup_item_t *it;
+
+  if (h == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return NULL;
+  it = r->slot[h & (LOOKUP_RING - 1)];
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+  return it;
+}
+
+static void wake_relay(void) {
+  uint64_t one = 1;
+
+  /* it can only fail if the counter is full, and then the relay loop
+     has a wakeup pending anyway */
+  if (write(wakefd, &one, sizeof(one)) < 0) return;
+}
+
+static void *lookup_main(void *arg) {
+  lookup_thread_t *t = (lookup_thread_t *)arg;
+  lookup_item_t *it;
+  int done = 0;
+
+  for (;;) {
+    if (sem_trywait(&t->work) < 0) {
+      /* out of work. Tell the relay loop about the last ones before
+	 going to sleep */
+      if (done) {
+	wake_relay();
+	done = 0;
+      }
+      while (sem_wait(&t->work) < 0 && errno == EINTR);
+    }
+    it = ring_pop(&t->in);
+    it->verdict = udp_classify(&it->from, it->msg, &it->len);
+    ring_push(&t->out, it);
+    if (++done == LOOKUP_BATCH) {
+      wake_relay();
+      done = 0;
+    }
+  }
+  return NULL;
+}
+
+void lookup_start(void) {
+  sigset_t all, orig;
+  int i;
+
+  if (lookup_threads == 0) return;
+
+  if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    log_err_exit(-1, "Couldn't create the lookup thread eventfd: %s",
+		 strerror(errno));
+  if (event_add(&ev_wake, wakefd, EV_LOOKUP, NULL, 0) < 0)
+    log_err_exit(-1, "Couldn't add the lookup threads to the event loop");
+
+  threads = (lookup_thread_t *)allocate(sizeof(lookup_thread_t)
+					* lookup_threads);
+  memset(threads, 0, sizeof(lookup_thread_t) * lookup_threads);
+
+  /* the signals are for the relay loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &orig);
+  for (i = 0; i < lookup_threads; i++) {
+    sem_init(&threads[i].work, 0, 0);
+    if (pthread_create(&threads[i].tid, NULL, lookup_main, &threads[i]) != 0)
+      log_err_exit(-1, "Couldn't start lookup thread %i", i);
+  }
+  pthread_sigmask(SIG_SETMASK, &orig, NULL);
+  log_debug(1, "started %i lookup threads", lookup_threads);
+}
+
+int lookup_submit(int sock, const char *msg, int len,
+		  const struct sockaddr_in *from) {
+  lookup_thread_t *t = NULL;
+  lookup_item_t *it;
+  int i;
+
+  /* the next thread with room, round robin */
+  for (i = 0; i < lookup_threads; i++) {
+    t = &threads[next_thread];
+    if (++next_thread == lookup_threads) next_thread = 0;
+    if (t->inflight < LOOKUP_RING) break;
+  }
+  if (i == lookup_threads) {
+    lookup_inline++;
+    return 0;
+  }
+
+  if ((it = free_items) != NULL) free_items = it->next;
+  else it = (lookup_item_t *)allocate(sizeof(lookup_item_t));
+  it->sock = sock;
+  it->from = *from;
+  it->len = len;
+  memcpy(it->msg, msg, len);
+
+  t->inflight++;
+  ring_push(&t->in, it);
+  sem_post(&t->work);
+  lookup_handed++;
+  return 1;
+}
+
+void lookup_collect(void) {
+  lookup_thread_t *t;
+  lookup_item_t *it;
+  uint64_t n;
+  int i;
+
+  /* read the eventfd first. A thread that hands back a request after
+     this wakes us again */
+  if (read(wakefd, &n, sizeof(n)) == sizeof(n)) lookup_wakeups++;
+
+  for (i = 0; i < lookup_threads; i++) {
+    t = &threads[i];
+    while ((it = ring_pop(&t->out)) != NULL) {
+      t->inflight--;
+      udp_handle_classified(it->sock, it->msg, it->verdict, it->len,
+			    &it->from);
+      it->next = free_items;
+      free_items = it;
+    }
+  }
+}
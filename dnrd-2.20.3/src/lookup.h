@@ -0,0 +1,55 @@
+/*
+ * lookup.h - threads that answer requests from the master database
+ *            and the cache
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_LOOKUP_H_
+#define _DNRD_LOOKUP_H_
+
+#include <netinet/in.h>
+
+/* upper limit for --lookup-threads */
+#ifndef LOOKUP_MAX
+#define LOOKUP_MAX 16
+#endif
+/* requests a thread may have at once. A power of 2 */
+#ifndef LOOKUP_RING
+#define LOOKUP_RING 256
+#endif
+
+/* number of lookup threads, 0 to do the lookups in the relay loop */
+extern int lookup_threads;
+
+/* requests handed to the threads, and requests looked up in the relay
+   loop because all threads had their hands full. wakeups counts the
+   times the threads woke the relay loop */
+extern unsigned long lookup_handed, lookup_inline, lookup_wakeups;
+
+/* start the threads and register their wakeup with the event loop.
+   Called from run(), after event_init() */
+void lookup_start(void);
+
+/* hand a copy of the request msg to a thread. Returns 0 if they are
+   all busy, and the caller has to look it up itself */
+int lookup_submit(int sock, const char *msg, int len,
+		  const struct sockaddr_in *from);
+
+/* finish the requests the threads are through with. Called from the
+   relay loop when the threads woke it */
+void lookup_collect(void);
+
+#endif /* _DNRD_LOOKUP_H_ */
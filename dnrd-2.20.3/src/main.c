@@ -34,6 +34,7 @@
 #include <pwd.h>
 #include <dirent.h>
 #include <limits.h>
+#include <fcntl.h>
 
 #include "relay.h"
 #include "cache.h"
@@ -44,6 +45,11 @@
 #include "qid.h"
 #include "query.h"
 #include "dns.h"
+#include "worker.h"
+#include "upsock.h"
+#include "clock.h"
+#include "listener.h"
+#include "probe.h"
 
 static int is_writeable (const struct stat* st);
 static int user_groups_contain (gid_t file_gid);
@@ -156,18 +162,10 @@ void init_socket(void) {
     recv_addr.sin_port = servent ? servent->s_port : htons(53);
 
     /*
-     * Setup our DNS query reception socket.
+     * Setup our DNS query reception sockets, one for each address and
+     * worker.
      */
-    if ((isock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-			log_err_exit(-1, "isock: Couldn't open socket");
-		}
-    else {
-			int opt = 1;
-			setsockopt(isock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    }
-
-    if (bind(isock, (struct sockaddr *)&recv_addr, sizeof(recv_addr)) < 0)
-			log_err_exit(-1, "isock: Couldn't bind local address");
+    listener_open(recv_addr.sin_port);
 
     /*
      * Setup our DNS tcp proxy socket.
@@ -221,6 +219,7 @@ int main(int argc, char *argv[])
 	recv_addr.sin_family = AF_INET;
 	
 	openlog(progname, LOG_PID, LOG_DAEMON);
+	clock_update();
 	
 	/* create the interface list */
 	inf_list = alloc_infnode();
@@ -233,6 +232,10 @@ int main(int argc, char *argv[])
 	 * Parse the command line.
      */
 	parse_args(argc, argv);
+
+	/* server health is shared by the workers */
+	if (workers > 1)
+		worker_share_servers();
 	
 	/* we change to the dnrd-root dir */
 	chdir(dnrd_root);
@@ -262,6 +265,10 @@ int main(int argc, char *argv[])
 	
 	/* init the qid pool */
 	qid_init_pool();
+
+	/* shared upstream sockets are bound to their devices while we
+	   are still root */
+	upsock_open();
 	
 #ifndef EXCLUDE_MASTER
 	/* Initialise out master DNS */
@@ -270,6 +277,8 @@ int main(int argc, char *argv[])
 	
 	/* init query list */
 	query_init();
+	/* and the probes that are left when a query is answered */
+	probe_init();
 
 	/* init dns validation table */
 	init_dns();
@@ -351,6 +360,10 @@ int main(int argc, char *argv[])
 #endif
 	
 	
+	/* start the other workers */
+	worker_start();
+	upsock_keep(worker_id);
+
 	sort();
 	/*
 	 * Run forever.
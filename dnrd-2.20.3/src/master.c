@@ -32,6 +32,7 @@
 #define _GNU_SOURCE
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <netdb.h>
 #include <sys/types.h>
@@ -56,6 +57,10 @@
 
 #define	DEFAULT_TTL		(60 * 60)
 
+/* the lookup threads read the database while the relay loop may
+   reload it */
+static pthread_rwlock_t master_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 typedef struct _string {
     unsigned int code;
     char	*string;
@@ -632,7 +637,8 @@ static int end_assembly(dnsheader_t *x)
 
 static dnsheader_t *begin_assembly(rr_t *query)
 {
-    static dnsheader_t *x = NULL;
+    /* one per thread, the lookup threads assemble answers too */
+    static __thread dnsheader_t *x = NULL;
 
     if (x == NULL) {
 	x = allocate(sizeof(dnsheader_t));
@@ -786,14 +792,26 @@ int master_init(void)
  * overflow might occur.  Otherwise the answer packets are
  * relatively small.  They should always fit into 512 bytes.
  */
+static int find_answer(unsigned char *msg, int len);
+
 int master_lookup(unsigned char *msg, int len)
+{
+    int		n;
+
+    if (master_onoff == 0) return (0);
+
+    pthread_rwlock_rdlock(&master_lock);
+    n = find_answer(msg, len);
+    pthread_rwlock_unlock(&master_lock);
+    return (n);
+}
+
+static int find_answer(unsigned char *msg, int len)
 {
     char	*domain;
     rr_t	query;
     dnsrec_t *rec;
 
-    if (master_onoff == 0) return (0);
-
 
     if (master_initialised == 0) {
 	master_init();
@@ -996,8 +1014,10 @@ int master_reinit(void)
     }
 
     if (master_reload != 0) {
+	pthread_rwlock_wrlock(&master_lock);
         reset_master();
         master_init();
+	pthread_rwlock_unlock(&master_lock);
     }
 
     master_reload = 0;
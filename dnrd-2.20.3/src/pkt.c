@@ -0,0 +1,70 @@
+/*
+ * pkt.c - pooled, reference counted packet buffers
+ *
+ * A reply from upstream is received into a buffer once. The cache and
+ * the send queue take references to it instead of copies, and the
+ * buffer goes back to the pool when the last of them is done with it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+
+#include "lib.h"
+#include "pkt.h"
+
+unsigned long pkt_allocs = 0;
+
+static pkt_t *pool = NULL;
+static int    npool = 0;
+
+pkt_t *pkt_get(void) {
+  pkt_t *p;
+
+  if ((p = pool) != NULL) {
+    pool = p->next;
+    npool--;
+    p->refs = 1;
+    p->len = 0;
+    p->next = NULL;
+    return p;
+  }
+  pkt_allocs++;
+  return pkt_alloc();
+}
+
+pkt_t *pkt_alloc(void) {
+  pkt_t *p = (pkt_t *)allocate(sizeof(pkt_t));
+
+  p->refs = 1;
+  return p;
+}
+
+pkt_t *pkt_ref(pkt_t *p) {
+  p->refs++;
+  return p;
+}
+
+void pkt_put(pkt_t *p) {
+  if (--p->refs > 0) return;
+  if (npool < PKT_POOL) {
+    p->next = pool;
+    pool = p;
+    npool++;
+  } else free(p);
+}
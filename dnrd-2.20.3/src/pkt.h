@@ -0,0 +1,54 @@
+/*
+ * pkt.h - pooled, reference counted packet buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_PKT_H_
+#define _DNRD_PKT_H_
+
+#include "check.h"
+
+/* max number of free buffers kept for reuse */
+#ifndef PKT_POOL
+#define PKT_POOL 256
+#endif
+
+/* A packet buffer. The data is not changed once it is shared, the
+ * qid is patched in on the way out instead. */
+typedef struct _pkt {
+  int           refs;
+  int           len;
+  struct _pkt  *next; /* in the free list */
+  char          data[UDP_MAXSIZE+4];
+} pkt_t;
+
+/* buffers that had to be malloc'ed */
+extern unsigned long pkt_allocs;
+
+/* get an empty buffer with one reference. The pool belongs to the
+ * relay loop; other threads use pkt_alloc() */
+pkt_t *pkt_get(void);
+
+/* a new buffer with one reference, not taken from the pool */
+pkt_t *pkt_alloc(void);
+
+/* take another reference to p */
+pkt_t *pkt_ref(pkt_t *p);
+
+/* drop a reference. The buffer goes back to the pool with the last one */
+void pkt_put(pkt_t *p);
+
+#endif /* _DNRD_PKT_H_ */
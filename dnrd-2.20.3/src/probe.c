@@ -0,0 +1,130 @@
+/*
+ * probe.c - the legs of an answered query that are still out
+ *
+ * When the client has its answer, the other legs of a query are only
+ * good for hearing from their servers: the reply shows the server is
+ * alive and gives its rtt. The query does not wait for them. With shared
+ * sockets each leg still out is handed to a probe that holds the server,
+ * the time it was sent and the qid, and the query is deleted. The reply
+ * still comes in on the shared socket. A query with sockets of its own
+ * closes them instead, see drop_legs() in udp.c.
+ *
+ * The probes come from a fixed pool. A query whose legs don't all fit
+ * waits for them itself, as it always did.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+
+#include "common.h"
+#include "lib.h"
+#include "qid.h"
+#include "query.h"
+#include "probe.h"
+
+int probe_pending = 0;
+unsigned long probes_taken = 0, probes_answered = 0, probes_expired = 0;
+
+static probe_t *pool, *pool_end;
+static probe_t *free_probes = NULL;
+static int probes_free = 0;
+
+void probe_init(void) {
+  int i;
+
+  pool = (probe_t *)allocate(sizeof(probe_t) * max_sockets);
+  pool_end = pool + max_sockets;
+  for (i = max_sockets - 1; i >= 0; i--) {
+    pool[i].next = free_probes;
+    free_probes = &pool[i];
+  }
+  probes_free = max_sockets;
+}
+
+int probe_owns(const void *owner) {
+  return (const probe_t *)owner >= pool && (const probe_t *)owner < pool_end;
+}
+
+static void probe_expire(void *arg) {
+  probes_expired++;
+  probe_done((probe_t *)arg);
+}
+
+int probe_take(query_t *q) {
+  probe_t *p, *head = NULL;
+  int c, n = 0;
+
+  /* a leg without a server can't be answered, it is dropped */
+  for (c = 0; c < q->npaths; c++)
+    if ((q->legs_out & (1 << c)) && q->srv_list[c] != NULL) n++;
+  if (n == 0 || n > probes_free) return 0;
+
+  for (c = 0; c < q->npaths; c++) {
+    if (!(q->legs_out & (1 << c)) || q->srv_list[c] == NULL) continue;
+
+    p = free_probes;
+    free_probes = p->next;
+    probes_free--;
+    probe_pending++;
+    probes_taken++;
+
+    p->srv = q->srv_list[c];
+    p->inf = q->inf_list[c];
+    p->tried = q->tried[c];
+    p->sent = q->sent[c];
+    p->tries = q->tries[c];
+    p->qid = q->my_qid;
+    p->fd = q->sock_arr[c];
+    timer_set(&p->timer, q->client_time + q->ttl + 1, probe_expire, p);
+    p->qnext = head;
+    head = p;
+  }
+
+  /* the qid stays taken until the last of them is done */
+  qid_pass(q->my_qid, head);
+  return 1;
+}
+
+probe_t *probe_find(unsigned short qid, int fd, const struct sockaddr_in *from,
+		    srvnode_t **srv) {
+  probe_t *p = (probe_t *)qid_owner(qid);
+
+  if (!probe_owns(p)) return NULL;
+  for (; p; p = p->qnext)
+    if (p->fd == fd && (*srv = server_in_mask(p->inf, p->tried, from)) != NULL)
+      return p;
+  return NULL;
+}
+
+void probe_done(probe_t *p) {
+  probe_t **pp, *head = (probe_t *)qid_owner(p->qid);
+
+  timer_del(&p->timer);
+
+  /* unlink it from the probes of its qid */
+  for (pp = &head; *pp != p; pp = &(*pp)->qnext);
+  *pp = p->qnext;
+  if (head == NULL) qid_return(p->qid);
+  else qid_pass(p->qid, head);
+
+  p->next = free_probes;
+  free_probes = p;
+  probes_free++;
+  probe_pending--;
+}
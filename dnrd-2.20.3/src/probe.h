@@ -0,0 +1,65 @@
+/*
+ * probe.h - the legs of an answered query that are still out
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_PROBE_H_
+#define _DNRD_PROBE_H_
+
+#include <netinet/in.h>
+#include "srvnode.h"
+#include "infnode.h"
+#include "query.h"
+#include "timer.h"
+
+typedef struct _probe {
+  srvnode_t         *srv;    /* the server the leg was last sent to */
+  infnode_t         *inf;    /* its interface */
+  unsigned int       tried;  /* all servers it was sent to, see server_bit() */
+  msec_t             sent;   /* when it was last sent */
+  unsigned char      tries;  /* times it was sent */
+  unsigned short     qid;    /* the qid the reply carries */
+  int                fd;     /* the shared socket it was sent through */
+  tmr_t              timer;  /* fires when the query would have timed out */
+  struct _probe     *qnext;  /* next probe with the same qid */
+  struct _probe     *next;   /* on the free list */
+} probe_t;
+
+/* probes waiting, and legs handed to a probe, answered and timed out */
+extern int probe_pending;
+extern unsigned long probes_taken, probes_answered, probes_expired;
+
+/* set up room for max_sockets probes. Called after query_init() */
+void probe_init(void);
+
+/* hand the legs of the answered query q that are still out to probes,
+   with its qid. Only for queries on shared sockets. Returns 1 if they all got one and q can
+   be deleted, 0 if there wasn't room and q has to wait for them */
+int probe_take(query_t *q);
+
+/* is owner of a qid a probe rather than a query? */
+int probe_owns(const void *owner);
+
+/* the probe for a reply with the given qid from the server at from
+   that came in on socket fd, NULL if there is none. *srv is set to
+   that server */
+probe_t *probe_find(unsigned short qid, int fd, const struct sockaddr_in *from,
+		    srvnode_t **srv);
+
+/* the reply for p has come, or it is no longer wanted */
+void probe_done(probe_t *p);
+
+#endif /* _DNRD_PROBE_H_ */
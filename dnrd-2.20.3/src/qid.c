@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <assert.h>
 #include "rand.h"
 #include "common.h"
 #include "qid.h"
@@ -14,6 +16,10 @@
 static unsigned short int qid_pool[QID_POOL_SIZE];
 static int pool_ptr = QID_POOL_SIZE - 1;
 
+/* what each qid that is handed out belongs to, NULL for the free ones.
+   A reply is matched by the qid in it with a single lookup */
+static void *qid_tab[QID_POOL_SIZE];
+
 
 static randctx isaac_ctx;
 
@@ -27,19 +33,22 @@ void qid_init_pool(void) {
    */
   struct timeval tv;
 
-  for (i=0; i<QID_POOL_SIZE; i++)
+  for (i=0; i<QID_POOL_SIZE; i++) {
     qid_pool[i] = i;
+    qid_tab[i] = NULL;
+  }
+  pool_ptr = QID_POOL_SIZE - 1;
 
-  /* get random seed from time */
+  /* get random seed from time and pid, so that workers differ */
   for (i=0; i<RANDSIZ; i++) {
     gettimeofday(&tv,0);
-    isaac_ctx.randrsl[i] = tv.tv_sec + tv.tv_usec;
+    isaac_ctx.randrsl[i] = tv.tv_sec + tv.tv_usec + getpid();
   }
   /* init prng */
   randinit(&isaac_ctx, TRUE);
 }
 
-unsigned short int qid_get(void) {
+unsigned short int qid_get(void *owner) {
   unsigned short int t;
   int i = myrand(pool_ptr) % QID_POOL_SIZE;
   /*
@@ -48,12 +57,33 @@ unsigned short int qid_get(void) {
   t = qid_pool[i];
   /* shrink the pool */
   qid_pool[i] = qid_pool[pool_ptr-- % QID_POOL_SIZE];
+  /* a qid in the pool must not be in use */
+  assert(qid_tab[t] == NULL);
+  qid_tab[t] = owner;
   return(t);
 }
 
+/* the owner of qid, NULL if it isn't handed out */
+void *qid_owner(unsigned short int qid) {
+  return qid_tab[qid];
+}
+
+void qid_pass(unsigned short int qid, void *owner) {
+  assert(qid_tab[qid] != NULL && owner != NULL);
+  qid_tab[qid] = owner;
+}
+
+/* number of qids that can still be handed out */
+int qid_free(void) {
+  return pool_ptr + 1;
+}
+
 unsigned short int qid_return(unsigned short int qid) {
   /* 
  if ((pool_ptr+1) == QID_POOL_SIZE) 
  log_debug("return_qid: qid pool is already full."); */
+  /* returning it twice would hand it out to two queries */
+  assert(qid_tab[qid] != NULL);
+  qid_tab[qid] = NULL;
   return (qid_pool[++pool_ptr % QID_POOL_SIZE] = qid);
 }
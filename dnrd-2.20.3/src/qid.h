@@ -7,9 +7,15 @@
 #ifndef qid_h
 #define qid_h
 
-unsigned short int qid_get(void);
+/* a random unused qid for owner, which qid_owner() returns until the
+   qid is returned */
+unsigned short int qid_get(void *owner);
+void *qid_owner(unsigned short int qid);
+/* let owner have the qid that is handed out to another one */
+void qid_pass(unsigned short int qid, void *owner);
 unsigned short int qid_return(unsigned short int qid);
 void qid_init_pool(void);
+int qid_free(void);
 int myrand(int max);
 
 #endif
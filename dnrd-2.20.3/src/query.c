@@ -35,11 +35,17 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <ctype.h>
 
 #include "lib.h"
 #include "common.h"
 #include "query.h"
 #include "qid.h"
+#include "sendq.h"
+#include "upsock.h"
+#include "relay.h"
+#include "udp.h"
+#include "probe.h"
 
 
 query_t qlist; /* the active query list */
@@ -51,9 +57,206 @@ int upstream_sockets = 0; /* number of upstream sockets */
 
 static int dropping = 0; /* dropping new packets */
 
+/* the client queries by client address, port, qid and question, so a
+   request the client sends again finds the query it already has */
+#define QHASH_SIZE 8192 /* a power of 2 */
+static query_t *dedup_tab[QHASH_SIZE];
+static unsigned int dedup_seed;
+
+/* the client queries by question and server, so other clients asking
+   the same can wait for the reply instead of sending it again */
+static query_t *coalesce_tab[QHASH_SIZE];
+
+int coalesce_max = COALESCE_MAX;
+int coalesce_wait = COALESCE_WAIT;
+unsigned long coalesce_joined = 0, coalesce_full = 0;
+
+/* the query_t objects come from a slab with room for max_sockets of
+   them, set up once, so a burst of queries doesn't go to malloc. When
+   it is used up more are taken from the heap, and given back to it.
+   Each is followed by its per leg arrays, so it takes query_size bytes */
+static char *slab, *slab_end;
+static size_t query_size;
+static query_t *free_queries = NULL;
+static waiter_t *free_waiters = NULL;
+int query_inuse = 0, query_peak = 0, query_slab_size = 0;
+unsigned long query_heap = 0;
+unsigned long query_retransmits = 0;
+
+/* round n up to a multiple of 8 */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static void slab_init(void) {
+  query_t *q;
+  int i;
+
+  query_size = ALIGN8(sizeof(query_t))
+    + ALIGN8(fanout_width * sizeof(event_t))
+    + fanout_width * (sizeof(srvnode_t *) + sizeof(infnode_t *)
+		      + sizeof(msec_t) + 2 * sizeof(int) + 1);
+  query_size = ALIGN8(query_size);
+
+  query_slab_size = max_sockets;
+  slab = (char *)allocate(query_size * query_slab_size);
+  slab_end = slab + query_size * query_slab_size;
+  for (i = query_slab_size - 1; i >= 0; i--) {
+    q = (query_t *)(slab + query_size * i);
+    q->next = free_queries;
+    free_queries = q;
+  }
+}
+
+/* a zeroed query_t, with its per leg arrays. They are laid out by
+   alignment, largest first */
+static query_t *query_alloc(void) {
+  query_t *q;
+  char *p;
+
+  if ((q = free_queries) != NULL) {
+    free_queries = q->next;
+  } else {
+    q = (query_t *)allocate(query_size);
+    query_heap++;
+  }
+  memset(q, 0, query_size);
+  p = (char *)q + ALIGN8(sizeof(query_t));
+  q->ev_arr = (event_t *)p;
+  p += ALIGN8(fanout_width * sizeof(event_t));
+  q->srv_list = (srvnode_t **)p;
+  p += fanout_width * sizeof(srvnode_t *);
+  q->inf_list = (infnode_t **)p;
+  p += fanout_width * sizeof(infnode_t *);
+  q->sent = (msec_t *)p;
+  p += fanout_width * sizeof(msec_t);
+  q->sock_arr = (int *)p;
+  p += fanout_width * sizeof(int);
+  q->tried = (unsigned int *)p;
+  p += fanout_width * sizeof(unsigned int);
+  q->tries = (unsigned char *)p;
+
+  if (++query_inuse > query_peak) query_peak = query_inuse;
+  return q;
+}
+
+static void query_free(query_t *q) {
+  query_inuse--;
+  if ((char *)q >= slab && (char *)q < slab_end) {
+    q->next = free_queries;
+    free_queries = q;
+  } else free(q);
+}
+
 /* init the query list */
 void query_init() {
-  qlist_tail = (qlist.next = &qlist);
+  infnode_t *i;
+  int n = 0;
+
+  /* a query can't take more paths than there are interfaces */
+  for (i = inf_list->next; i != inf_list; i = i->next) n++;
+  if (n > 0 && fanout_width > n) {
+    log_debug(1, "fanout width cut down to the %i interfaces", n);
+    fanout_width = n;
+  }
+
+  qlist_tail = (qlist.next = qlist.prev = &qlist);
+  dedup_seed = myrand(65536) << 16 | myrand(65536);
+  slab_init();
+}
+
+/* hash of the question of the request msg: the name, without regard
+   to case, and the type and class */
+static unsigned int question_hash(const char *msg, unsigned len) {
+  const unsigned char *p = (const unsigned char *)msg + 12;
+  const unsigned char *end = (const unsigned char *)msg + len;
+  unsigned int h = 2166136261u;
+  int n;
+
+  while (p < end && *p != 0) {
+    n = *p++;
+    h = (h ^ n) * 16777619u;
+    for (; n > 0 && p < end; n--)
+      h = (h ^ tolower(*p++)) * 16777619u;
+  }
+  /* the root label, type and class */
+  for (n = 0; n < 5 && p < end; n++)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+static query_t **dedup_bucket(const struct sockaddr_in *client,
+			      unsigned short client_qid, unsigned int qhash) {
+  unsigned int h = dedup_seed ^ qhash;
+
+  h = (h ^ client->sin_addr.s_addr) * 2654435761u;
+  h = (h ^ ((unsigned int)client->sin_port << 16 | client_qid)) * 2654435761u;
+  return &dedup_tab[(h >> 16) & (QHASH_SIZE - 1)];
+}
+
+static query_t *dedup_find(const struct sockaddr_in *client,
+			   unsigned short client_qid, unsigned int qhash) {
+  query_t *q;
+
+  for (q = *dedup_bucket(client, client_qid, qhash); q; q = q->dnext)
+    if (q->client_qid == client_qid && q->qhash == qhash
+	&& q->client.sin_port == client->sin_port
+	&& q->client.sin_addr.s_addr == client->sin_addr.s_addr)
+      return q;
+  return NULL;
+}
+
+static void dedup_add(query_t *q) {
+  query_t **b = dedup_bucket(&q->client, q->client_qid, q->qhash);
+
+  if ((q->dnext = *b) != NULL) q->dnext->dprev = &q->dnext;
+  q->dprev = b;
+  *b = q;
+}
+
+static void dedup_del(query_t *q) {
+  if (q->dprev == NULL) return;
+  if ((*q->dprev = q->dnext) != NULL) q->dnext->dprev = q->dprev;
+  q->dnext = NULL;
+  q->dprev = NULL;
+}
+
+/* the header bits that change the answer: RD and CD */
+static unsigned char question_flags(const char *msg) {
+  return (msg[2] & 0x01) | (msg[3] & 0x10);
+}
+
+static query_t **coalesce_bucket(srvnode_t *srv, unsigned int qhash,
+				 unsigned char qflags) {
+  unsigned int h = (dedup_seed ^ qhash ^ qflags) * 2654435761u;
+
+  h = (h ^ (unsigned int)(unsigned long)srv) * 2654435761u;
+  return &coalesce_tab[(h >> 16) & (QHASH_SIZE - 1)];
+}
+
+static void coalesce_add(query_t *q) {
+  query_t **b = coalesce_bucket(q->srv, q->qhash, q->qflags);
+
+  if ((q->cnext = *b) != NULL) q->cnext->cprev = &q->cnext;
+  q->cprev = b;
+  *b = q;
+}
+
+static void coalesce_del(query_t *q) {
+  waiter_t *w;
+
+  while ((w = q->waiters) != NULL) {
+    q->waiters = w->next;
+    w->next = free_waiters;
+    free_waiters = w;
+  }
+  if (q->cprev == NULL) return;
+  if ((*q->cprev = q->cnext) != NULL) q->cnext->cprev = q->cprev;
+  q->cnext = NULL;
+  q->cprev = NULL;
+}
+
+static int same_client(const struct sockaddr_in *a,
+		       const struct sockaddr_in *b) {
+  return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
 }
 
 /* Returns 1 if port excluded and zero otherwise. 
@@ -70,54 +273,57 @@ int is_port_excluded(int port)
 	return 0;
 }
 
-/* create a new query, and open a socket to the server */
-query_t *query_create(infnode_t *i, srvnode_t *s) {
-  query_t *q;
+/* unregister and close the first n sockets of a query */
+static void close_socks(query_t *q, int n) {
+  while (n--) {
+    event_del(&q->ev_arr[n]);
+    close(q->sock_arr[n]);
+    upstream_sockets--;
+  }
+}
+
+/* bind sock to a random source port that is not excluded with -x */
+int bind_random_port(int sock) {
 #ifdef RANDOM_SRC
   struct sockaddr_in my_addr;
-#endif
 
-  /* should never be called with no server */
-  assert(s != NULL);
+  memset(&my_addr, 0, sizeof(my_addr));
+  my_addr.sin_family = AF_INET;
+  my_addr.sin_addr.s_addr = INADDR_ANY;
 
-  /* check if we have reached maximum of sockets */
-  if (upstream_sockets >= max_sockets) {
-    if (!dropping)
-      log_msg(LOG_WARNING, "Socket limit reached. Dropping new queries");
-    return NULL;
+  do
+  {
+    my_addr.sin_port = htons( myrand(65536-1026)+1025 );
   }
+  while(is_port_excluded(my_addr.sin_port));
 
-  dropping=0;
-  /* allocate */
-  if ((q=(query_t *) allocate(sizeof(query_t))) == NULL)
-    return NULL;
-
-  /* return an emtpy circular list */
-  q->next = (struct _query *)q;
+  if (bind(sock, (struct sockaddr *)&my_addr,
+	   sizeof(struct sockaddr)) == -1) {
+    log_msg(LOG_WARNING, "bind: while creating query %s", strerror(errno));
+    return -1;
+  }
+#endif
+  return 0;
+}
 
-  /* Set flag if we are creating a dummy query or or a real one */
-  if (!i)
-    q->is_dummy = 1;
-  else
-    q->is_dummy = 0;
-  
-  q->srv = s;
+/* a socket of a query only gets a reply or two, the kernel's drop
+   count is only looked at on the shared sockets */
+static void set_buffers(int sock) {
+  if (upstream_rcvbuf || upstream_sndbuf)
+    udp_sock_setup(sock, upstream_rcvbuf, upstream_sndbuf);
+}
 
-  /* set the default time to live value */
-  q->ttl = forward_timeout;
-  
-  /* open all of 3 new sockets */
-  // TODO: Currently we are creating 3 sockets and random ports irrespective of if we
-  // have at least 3 servers or not to forward queries to and hence use these 3 sockets.
-  // This could be fixed latter.
+/* open the fanout_width upstream sockets of a query (1 for a dummy
+   query) */
+static int open_socks(query_t *q) {
   int c;
-  for(c=0; c<3; ++c)
+  for(c=0; c<fanout_width; ++c)
   {
   	if ((q->sock_arr[c] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
         {
     		log_msg(LOG_ERR, "query_create: Couldn't open socket");
-    	        free(q);
-                return NULL;
+  	        close_socks(q, c);
+                return -1;
   	} 
         else upstream_sockets++;
   
@@ -138,68 +344,145 @@ query_t *query_create(infnode_t *i, srvnode_t *s) {
     setsockopt(q->sock_arr[c], IPPROTO_IP, IP_PKTINFO, &opt, sizeof(opt));
 
   /* bind to random source port */
-#ifdef RANDOM_SRC
-  	memset(&my_addr, 0, sizeof(my_addr));
-  	my_addr.sin_family = AF_INET;
-  	my_addr.sin_addr.s_addr = INADDR_ANY;
-
-        do
-        {
-  		my_addr.sin_port = htons( myrand(65536-1026)+1025 );
-	}
-	while(is_port_excluded(my_addr.sin_port));
-	
-  	if (bind(q->sock_arr[c], (struct sockaddr *)&my_addr, 
-	   sizeof(struct sockaddr)) == -1) {
-    	   log_msg(LOG_WARNING, "bind: while creating query %s", strerror(errno));
-  	}
-#endif
+  	bind_random_port(q->sock_arr[c]);
 
+  	set_buffers(q->sock_arr[c]);
   	/* Make the socket non-blocking */
   	fcntl(q->sock_arr[c], F_SETFL, O_NONBLOCK);
-
-  	/* add the socket to the master FD set */
-  	FD_SET(q->sock_arr[c], &fdmaster);
-
-  	if (q->sock_arr[c] > maxsock)
-		 maxsock = q->sock_arr[c];
+  	busy_poll_sock(q->sock_arr[c]);
+
+  	/* let the event loop know about the socket */
+  	if (event_add(&q->ev_arr[c], q->sock_arr[c], EV_QUERY, q, c) < 0) {
+  	  close(q->sock_arr[c]);
+  	  upstream_sockets--;
+  	  close_socks(q, c);
+  	  return -1;
+  	}
 
 	if(q->is_dummy == 1) /* Allocate only a single socket for dummy queries */
 		break;
   }
+  return 0;
+}
 
-  /* get an unused QID */
-  q->my_qid = qid_get();
-  return q;
+/* is there room for another query? With shared sockets we are only
+   limited by the number of free qids, else by max_sockets */
+int query_room(void) {
+  return shared_sockets ? qid_free() > 0 : upstream_sockets < max_sockets;
 }
 
-query_t *query_destroy(query_t *q) {
-  /* close the socket and return mem */
-  qid_return(q->my_qid);
+/* create a new query, and open a socket to the server */
+query_t *query_create(infnode_t *i, srvnode_t *s) {
+  query_t *q;
 
-  /* unset the sockets */
-  int i;
-  for(i=0; i<3; ++i)
-  {
-  	FD_CLR(q->sock_arr[i], &fdmaster);
-  	close(q->sock_arr[i]);
-  	upstream_sockets--;
+  /* should never be called with no server */
+  assert(s != NULL);
 
-	if(q->is_dummy == 1) /* dummy queries only have a single socket */
-		break;
+  /* check if we have reached maximum of sockets */
+  if (!query_room()) {
+    if (!dropping)
+      log_msg(LOG_WARNING, "Socket limit reached. Dropping new queries");
+    return NULL;
   }
 
-  total_queries++;
+  dropping=0;
+  /* allocate */
+  if ((q=query_alloc()) == NULL)
+    return NULL;
+
+  /* return an emtpy circular list */
+  q->next = q->prev = (struct _query *)q;
+
+  /* Set flag if we are creating a dummy query or or a real one */
+  if (!i)
+    q->is_dummy = 1;
+  else
+    q->is_dummy = 0;
   
-  if(q->fail_msg_len > 0)//q->cached_fail_msg)
-  {
-    free(q->cached_fail_msg);
+  q->srv = s;
+
+  /* set the default time to live value */
+  q->ttl = forward_timeout;
+  
+  /* open all of its new sockets, unless the interface sockets are
+     used. Those are picked when the query is sent. */
+  if (shared_sockets) {
+    int c;
+    for (c = 0; c < fanout_width; c++) q->sock_arr[c] = -1;
+  } else if (open_socks(q) < 0) {
+    query_free(q);
+    return NULL;
   }
+
+  /* get an unused QID */
+  q->my_qid = qid_get(q);
+  return q;
+}
+
+query_t *query_destroy(query_t *q) {
+  /* close the socket and return mem. The qid is kept if probes took
+     it over */
+  if (qid_owner(q->my_qid) == q)
+    qid_return(q->my_qid);
+  dedup_del(q);
+  coalesce_del(q);
+  timer_del(&q->timer);
+  timer_del(&q->rtx_timer);
+  timer_del(&q->hedge_timer);
+
+  /* unset the sockets. dummy queries only have a single socket. Shared
+     sockets belong to the interface */
+  if (!shared_sockets)
+    close_socks(q, q->is_dummy ? 1 : fanout_width);
+
+  total_queries++;
   
-  free(q);
+  if (q->fail_pkt)
+    pkt_put(q->fail_pkt);
+  if (q->qpkt)
+    pkt_put(q->qpkt);
+  
+  query_free(q);
   return NULL;
 }
 
+/* q has not been answered within its ttl */
+static void query_expire(void *arg) {
+  query_t *q = (query_t *)arg;
+
+  log_debug(3, "q->resp_sent %d msg len %d", q->resp_sent,
+	    q->fail_pkt ? q->fail_pkt->len : 0);
+
+  if(q->fail_pkt && q->resp_sent == 0)
+  {
+    log_debug(3, "Forwarding the failed reply to host %s since no successfull response received", inet_ntoa(q->client.sin_addr));
+
+    query_answer(q, q->fail_pkt);
+  }
+
+  log_debug(2, "query_timeout: removing query %i", q->my_qid);
+  total_timeouts++;
+  query_delete_next(q->prev);
+}
+
+/* (re)start the timeout of q from the last request of the client */
+static void query_arm(query_t *q) {
+  timer_set(&q->timer, q->client_time + q->ttl + 1, query_expire, q);
+}
+
+void query_set_ttl(query_t *q, msec_t ttl) {
+  q->ttl = ttl;
+  query_arm(q);
+}
+
+/* find the query that uses qid (host byte order) */
+query_t *query_find(unsigned short qid) {
+  void *owner = qid_owner(qid);
+
+  /* the qid of an answered query may be left to its probes */
+  return probe_owns(owner) ? NULL : (query_t *)owner;
+}
+
 /* Get a new query */
 query_t *query_get_new(infnode_t *inf, srvnode_t *srv) {
   query_t *q;
@@ -221,25 +504,24 @@ query_t *query_add(infnode_t *inf, srvnode_t *srv,
 		   const struct sockaddr_in* client, char* msg, 
 		   unsigned len) {
 
-  query_t *q, *p, *oldtail;
+  query_t *q, *oldtail;
   unsigned short client_qid = *((unsigned short *)msg);
-  time_t now = time(NULL);
+  unsigned int qhash = 0;
+  msec_t now = clock_ms;
 
   /* 
-     look if the query are in the list 
-     if it is, don't add it again. 
+     look if the client has sent this query before
+     if it has, don't add it again. Dummy queries have no client
   */
-  for (p=&qlist; p->next != &qlist; p = p->next) {
-    if (p->next->client_qid == client_qid) {
-      /* we found the qid in the list */
-      *((unsigned short *)msg) = p->next->my_qid;
-      p->next->client_time = now;
+  if (inf != NULL) {
+    qhash = question_hash(msg, len);
+    if ((q = dedup_find(client, client_qid, qhash)) != NULL) {
+      *((unsigned short *)msg) = htons(q->my_qid);
+      q->client_time = now;
+      query_arm(q);
       log_debug(2, "Query %i from client already in list. Count=%i", 
-		client_qid, p->next->client_count++);
-
-  //printf("Query qid %d and client qid %d\n", q->my_qid, q->client_qid);
-
-      return p;
+		client_qid, q->client_count++);
+      return q->prev;
     }
   }
 
@@ -250,8 +532,16 @@ query_t *query_add(infnode_t *inf, srvnode_t *srv,
 
   q->client_qid = client_qid;
   memcpy(&(q->client), client, sizeof(struct sockaddr_in));
+  if (inf != NULL) {
+    q->qhash = qhash;
+    dedup_add(q);
+    q->qflags = question_flags(msg);
+    q->started = now;
+    coalesce_add(q);
+  }
   q->client_time = now;
   q->client_count = 1;
+  query_arm(q);
 
   /* set new qid from random generator */
   *((unsigned short *)msg) = htons(q->my_qid);
@@ -260,7 +550,9 @@ query_t *query_add(infnode_t *inf, srvnode_t *srv,
 
   /* add the query to the list */
   q->next = qlist_tail->next;
+  q->prev = qlist_tail;
   qlist_tail->next = q;
+  q->next->prev = q;
 
   /* new query is new tail */
   oldtail = qlist_tail;
@@ -269,12 +561,77 @@ query_t *query_add(infnode_t *inf, srvnode_t *srv,
 
 }
 
+/*
+ * Let the client wait for the reply to a query for the same question
+ * that is on its way to srv already, rather than sending it again.
+ * Returns the query it joined, or NULL if the request needs a query of
+ * its own: nobody asked yet, the queries that did are answered, full
+ * or were sent more than coalesce_wait ms ago, or the client sent it
+ * before and query_add() deals with it.
+ */
+query_t *query_join(srvnode_t *srv, int sock,
+		    const struct sockaddr_in *client, const char *msg,
+		    unsigned len) {
+  unsigned short qid = *((unsigned short *)msg);
+  unsigned int qhash;
+  unsigned char qflags;
+  query_t *q;
+  waiter_t *w;
+
+  if (coalesce_max == 0) return NULL;
+
+  qhash = question_hash(msg, len);
+  qflags = question_flags(msg);
+  for (q = *coalesce_bucket(srv, qhash, qflags); q; q = q->cnext) {
+    if (q->qhash != qhash || q->qflags != qflags || q->srv != srv
+	|| q->resp_sent)
+      continue;
+    if (q->client_qid == qid && same_client(&q->client, client))
+      return NULL;
+    /* sent again while it waits */
+    for (w = q->waiters; w; w = w->next)
+      if (w->qid == qid && same_client(&w->client, client))
+	return q;
+    if (clock_ms - q->started > coalesce_wait) continue;
+    if (q->nwaiters >= coalesce_max) {
+      coalesce_full++;
+      continue;
+    }
+
+    if ((w = free_waiters) != NULL) free_waiters = w->next;
+    else w = (waiter_t *)allocate(sizeof(waiter_t));
+    w->client = *client;
+    w->sock = sock;
+    w->qid = qid;
+    w->next = q->waiters;
+    q->waiters = w;
+    q->nwaiters++;
+    coalesce_joined++;
+    log_debug(3, "Request %i from %s waits for query %i", ntohs(qid),
+	      inet_ntoa(client->sin_addr), q->my_qid);
+    return q;
+  }
+  return NULL;
+}
+
+/* send the reply p to the client of q and to those waiting with it,
+   each with its own qid */
+void query_answer(query_t *q, pkt_t *p) {
+  waiter_t *w;
+
+  sendq_add_pkt(q->client_sock, &q->client, p, q->client_qid);
+  for (w = q->waiters; w; w = w->next)
+    sendq_add_pkt(w->sock, &w->client, p, w->qid);
+  q->resp_sent = 1;
+}
+
 /* remove query after */
 query_t *query_delete_next(query_t *q) {
   query_t *tmp = q->next;
 
   /* unlink tmp */
   q->next = q->next->next;
+  q->next->prev = q;
  
   /* if this was the last query in the list, we need to update the tail */
   if (qlist_tail == tmp) {
@@ -286,38 +643,12 @@ query_t *query_delete_next(query_t *q) {
   return q;
 }
 
-
-/* remove old unanswered queries */
-void query_timeout(time_t age) {
-  int count=0;
-  time_t now = time(NULL);
-  query_t *q;
-  
-  /* NOTE: q->next is the current query */
-  for (q=&qlist; q->next != &qlist; q = q->next) {
-    if (q->next->client_time < (now - q->next->ttl)) {
-      count++;
-      
-      query_t *curr_q = q->next;
-      log_debug(3, "curr_q->resp_sent %d msg len %d", curr_q->resp_sent, curr_q->fail_msg_len);
-       
-      if(curr_q->fail_msg_len > 0 && curr_q->resp_sent == 0)
-      {
-        /* set the client qid */
-        *((unsigned short *)curr_q->cached_fail_msg) = curr_q->client_qid;
-        log_debug(3, "Forwarding the failed reply to host %s since no successfull response received", inet_ntoa(curr_q->client.sin_addr));
-      
-        if (sendto(isock, curr_q->cached_fail_msg, curr_q->fail_msg_len, 0, (const struct sockaddr *)&curr_q->client,
-          sizeof(struct sockaddr_in)) != curr_q->fail_msg_len) {
-	        log_debug(1, "sendto error %s", strerror(errno));
-	    }
-	  }
-	     
-      query_delete_next(q);
-    }
-  }
-  if (count) log_debug(1, "query_timeout: removed %d entries", count);
-  total_timeouts += count;
+/* the query before q in the list. This is what query_delete_next()
+   and udp_handle_reply() want, so a ready socket can be handled
+   without searching the list */
+query_t *query_prev(query_t *q) {
+  assert(q->prev->next == q);
+  return q->prev;
 }
 
 int query_count(void) {
@@ -331,7 +662,6 @@ int query_count(void) {
 }
 
 
-
 void query_dump_list(void) {
   query_t *p;
   for (p=&qlist; p->next != &qlist; p=p->next) {
@@ -31,15 +31,38 @@
 #include <sys/socket.h>
 #include "srvnode.h"
 #include "infnode.h"
+#include "event.h"
+#include "timer.h"
+#include "pkt.h"
+
+/* defaults for --coalesce and --coalesce-wait (ms) */
+#ifndef COALESCE_MAX
+#define COALESCE_MAX 16
+#endif
+#ifndef COALESCE_WAIT
+#define COALESCE_WAIT 500
+#endif
+
+/* a client waiting for the reply to a query another client asked first */
+typedef struct _waiter {
+  struct sockaddr_in client;
+  int                sock;  /* the listener socket it came in on */
+  unsigned short     qid;   /* its qid, as it sent it */
+  struct _waiter    *next;
+} waiter_t;
 
 typedef struct _query {
-  int sock_arr[3]; /* the communication socket array - one for each of the three simultaneously sent queries */
+  /* the per leg arrays have fanout_width entries each. They are kept
+     right after the query_t, see query_alloc() */
+  int *sock_arr; /* the communication socket array - one for each of the simultaneously sent queries */
+  event_t *ev_arr; /* event registration for each socket in sock_arr */
   srvnode_t *srv; /* the upstream server */
   int is_dummy; /* To differentiate between actual queries from clients or health check dummy queries */
   
   unsigned short my_qid; /* the local qid */
   unsigned short client_qid; /* the qid from the client */
   struct sockaddr_in client; /* */
+  int client_sock; /* the listener socket the query came in on */
 
   /* Count of how many servers this query currently has been sent to. This is used to keep track
    * of when to delete the query i.e. we delete when this count is zero. When we query multiple servers
@@ -51,22 +74,45 @@ typedef struct _query {
   /* This is needed when we received a single failure response, waited for others to respond. But they timeout.
    * Eventually we should be sending the first failure back to client. 
    */
-  char *cached_fail_msg;
-  int  fail_msg_len;
+  pkt_t *fail_pkt;
   
   /* Flag keeps track of whether we have responsed to client or not */
   int resp_sent;
 
   /*  int send_count; * number of retries */
   /*  time_t send_time; * time of last sent packet */
-  time_t client_time; /* last time we got this query from client */
+  msec_t client_time; /* last time we got this query from client */
   int client_count; /* number of times we got this same request */
 
-  time_t ttl; /* time to live for this query */
+  msec_t ttl; /* time to live for this query, ms */
+  tmr_t timer; /* fires ttl after the last request from the client */
 
-  srvnode_t *srv_list[3]; /* array of pointers to point to servers we send requests */
+  srvnode_t **srv_list; /* array of pointers to point to servers we send requests */
+  msec_t *sent; /* when each of them was last sent to */
+  infnode_t **inf_list; /* the interface of each of them */
+  unsigned char *tries; /* times each of them has been sent to */
+  unsigned int *tried; /* the servers of its interface each of them was
+			  sent to, see server_bit() */
+  unsigned char legs_out; /* bit per leg that is counted in serv_sent_cnt */
+  pkt_t *qpkt; /* the query as sent, for retransmissions */
+  tmr_t rtx_timer; /* fires at the next retransmission */
+  unsigned char npaths; /* entries of inf_list in use, set on the first send */
+  unsigned char hedges; /* bit per leg that was sent as a hedge */
+  tmr_t hedge_timer; /* fires when the next leg is due, --fanout=hedge */
 
   struct _query     *next; /* ptr to next query */
+  struct _query     *prev; /* ptr to previous query, so we can unlink in O(1) */
+
+  unsigned int       qhash; /* hash of the question, see query_add() */
+  struct _query     *dnext; /* next in the same bucket of the dedup table */
+  struct _query    **dprev; /* what points to us there, NULL if not in it */
+
+  unsigned char      qflags; /* the RD and CD bits of the request */
+  msec_t             started; /* when the first client asked */
+  waiter_t          *waiters; /* other clients that asked the same */
+  int                nwaiters;
+  struct _query     *cnext; /* next in the same bucket of the coalesce table */
+  struct _query    **cprev;
 
 } query_t;
 
@@ -74,6 +120,20 @@ extern query_t qlist;
 extern unsigned long total_queries;
 extern unsigned long total_timeouts;
 
+/* queries in use now and at most, the size of the slab they come
+   from, and the ones taken from the heap when it was used up */
+extern int query_inuse, query_peak, query_slab_size;
+extern unsigned long query_heap;
+/* queries sent again because a server didn't reply in time */
+extern unsigned long query_retransmits;
+
+/* max clients that may wait for another one's query, 0 to never let
+   them, and how long after it was sent (ms) a query may be joined */
+extern int coalesce_max;
+extern int coalesce_wait;
+/* requests that joined a query, and those that found it full */
+extern unsigned long coalesce_joined, coalesce_full;
+
 
 void query_init(void);
 query_t *query_create(infnode_t *i, srvnode_t *s);
@@ -85,9 +145,17 @@ query_t *query_add(infnode_t *inf, srvnode_t *srv, const struct sockaddr_in* cli
 		   unsigned len);
 //query_t *query_add(domnode_t *dom, srvnode_t *srv, const struct sockaddr_in* client, char* msg, 
 //		   unsigned len);
+query_t *query_join(srvnode_t *srv, int sock,
+		    const struct sockaddr_in *client, const char *msg,
+		    unsigned len);
+void query_answer(query_t *q, pkt_t *p);
 query_t *query_delete_next(query_t *q);
-void query_timeout(time_t age);
-void query_stats(time_t interval);
+query_t *query_prev(query_t *q);
+query_t *query_find(unsigned short qid);
+int query_room(void);
+int bind_random_port(int sock);
+void query_set_ttl(query_t *q, msec_t ttl);
+void query_stats(void *arg);
 
 
 #endif
@@ -40,6 +40,16 @@
 #include "udp.h"
 #include "dns.h"
 #include "sig.h"
+#include "event.h"
+#include "sendq.h"
+#include "pkt.h"
+#include "listener.h"
+#include "admit.h"
+#include "lookup.h"
+#include "upsock.h"
+#include "probe.h"
+#include "timer.h"
+#include "clock.h"
 
 #ifndef EXCLUDE_MASTER
 #include "master.h"
@@ -91,11 +101,24 @@ char *set_srvfail(char *msg, const int len) {
 int handle_query(const struct sockaddr_in *fromaddrp, char *msg, int *len,
 		 infnode_t **inf_ptr) //domnode_t **dptr)
 
+{
+    int fwd;
+
+    if ((fwd = classify_query(fromaddrp, msg, len)) != 1) return fwd;
+    return route_query(msg, len, inf_ptr);
+}
+
+/*
+ * classify_query()
+ *
+ * The first half of handle_query(): answer the query from the master
+ * database or the cache if we can. Same return values. It doesn't
+ * touch the servers or the queries, so the lookup threads can run it.
+ */
+int classify_query(const struct sockaddr_in *fromaddrp, char *msg, int *len)
 {
     int       replylen;
-    //domnode_t *d;
-    infnode_t   *inf;
-    
+
     if (opt_debug) {
 	char      cname_buf[256];
 
@@ -121,6 +144,20 @@ int handle_query(const struct sockaddr_in *fromaddrp, char *msg, int *len,
 	return 0;
     }  else if (replylen < 0) return -1;
 
+    return 1;
+}
+
+/*
+ * route_query()
+ *
+ * The second half of handle_query(): pick the server to forward the
+ * query to. Returns 1 with the interface in inf_ptr, or 0 with a
+ * "Server failure" reply in msg if all servers are deactivated.
+ */
+int route_query(char *msg, int *len, infnode_t **inf_ptr)
+{
+    infnode_t   *inf;
+
     /* get the server list for this interface */
     /* Since interface list is in sorted order, we send request to current server. */
     inf = inf_list->next;
@@ -152,11 +189,10 @@ int handle_query(const struct sockaddr_in *fromaddrp, char *msg, int *len,
     
     /* Send to a server until it "times out". */
     if (inf->current) {
-      time_t now = time(NULL);
       if ((inf->current->send_time != 0) 
 	  && (forward_timeout != 0)
 	  && (reactivate_interval != 0)
-	  && (now - inf->current->send_time > forward_timeout)) {
+	  && (clock_ms - inf->current->send_time > forward_timeout)) {
 	  deactivate_current(inf);
       }
     }
@@ -175,89 +211,206 @@ int handle_query(const struct sockaddr_in *fromaddrp, char *msg, int *len,
     return 1;
 }
 
-/* Check if any deactivated server are back online again */
+/* the housekeeping jobs */
+static tmr_t reactivate_timer, deactivate_timer, cache_timer;
+static tmr_t query_stats_timer, srv_stats_timer;
+
+/* Check if any deactivated server are back online again.
+   Runs every reactivate_interval seconds while there are any */
 
-static void reactivate_servers(int interval) {
-  time_t now=time(NULL);
-  static int last_try = 0;
+static void reactivate_servers(void *arg) {
   infnode_t *i = inf_list;
-  /*  srvnode_t *s;*/
-
-  if (!last_try) last_try = now;
-  /* check for reactivate servers */
-  if ( (now - last_try < interval))
-    return;
- 
-  last_try = now;
+  srvnode_t *s;
+  int inactive = 0;
+
   do {
     if (!no_srvlist(i->srvlist))
-      retry_srvlist(i, interval);
+      retry_srvlist(i, reactivate_interval);
+    if ((s=i->srvlist))
+      while ((s=s->next) != i->srvlist)
+	if (s->inactive) inactive++;
   } while ((i = i->next) != inf_list);  
+
+  if (inactive == 0) timer_del(&reactivate_timer);
+}
+
+void retry_servers(void) {
+  if (reactivate_interval != 0 && !timer_pending(&reactivate_timer))
+    timer_every(&reactivate_timer, MSEC(reactivate_interval),
+		reactivate_servers, NULL);
 }
-/* Check if any server are timing out and should be deactivated */
-static void deactivate_servers(int interval) {
-  time_t now=time(NULL);
-  static int last_try = 0;
-  
+
+/* Check if any server are timing out and should be deactivated.
+   Runs when the oldest unanswered request to a server times out */
+static void deactivate_servers(void *arg) {
   infnode_t *i = inf_list;
   srvnode_t *s;
-
-  if (!last_try) last_try = now;
-  if (now - last_try < interval)
-    return;
-  last_try = now;
+  msec_t first = 0;
 
   do {
     if ((s=i->srvlist)) 
       while ((s=s->next) != i->srvlist) {
         int current_disabled=0;
-	if (s->inactive) continue;
-	if (s->send_time
-	    && (difftime(now, s->send_time) > forward_timeout)) {
-	  s->inactive = now;
+	if (s->inactive || !s->send_time) continue;
+	if (clock_ms - s->send_time > forward_timeout) {
+	  s->inactive = clock_now;
 	  if (s == i->current) /* we need to update i->current */
 	    current_disabled=1; 
-	}
+	  retry_servers();
+	} else if (first == 0 || s->send_time < first)
+	  first = s->send_time;
 	if (current_disabled) deactivate_current(i);
       }
   } while ((i = i->next) != inf_list);  
+
+  /* the next server to time out, if it isn't answered before that */
+  if (first)
+    timer_set(&deactivate_timer, first + forward_timeout + 1,
+	      deactivate_servers, NULL);
 }
 
-void srv_stats(time_t interval) {
+void watch_servers(void) {
+  if (forward_timeout != 0 && reactivate_interval != 0
+      && !timer_pending(&deactivate_timer))
+    timer_set(&deactivate_timer, clock_ms + forward_timeout + 1,
+	      deactivate_servers, NULL);
+}
+
+/* print the send count of the servers. Runs every 10 seconds */
+static void srv_stats(void *arg) {
   srvnode_t *s;
   infnode_t *i=inf_list;
-  time_t now = time(NULL);
-  static time_t last=0;
-  
-  if (last + interval > now) {
-    last = now;
-    do {
-      if ((s=i->srvlist)) 
-	while ((s=s->next) != i->srvlist)
-	  log_debug(1, "stats for %s: send count=%i",
-		    inet_ntoa(s->addr.sin_addr), s->send_count);
-    } while ((i=i->next) != inf_list);
-  }
+
+  do {
+    if ((s=i->srvlist)) 
+      while ((s=s->next) != i->srvlist)
+	log_debug(4, "stats for %s: send count=%i, rtt=%i ms",
+		  inet_ntoa(s->addr.sin_addr), s->send_count, s->srtt);
+  } while ((i=i->next) != inf_list);
 }
 
 
-/* print statics about the query list and open sockets */
-void query_stats(time_t interval) {
-  time_t now = time(NULL);
-/*  int count; */ /* UNUSED */
-  static time_t last=0;
-	if (interval == 0) return;
-  if (last + interval < now) {
-    last = now;
-    log_msg(LOG_INFO, "Hits: %i, Misses: %i, Total: %i, Timeouts: %i", 
+/* print statics about the query list and open sockets. Runs every
+   stats_interval seconds */
+void query_stats(void *arg) {
+  log_msg(LOG_INFO, "Hits: %i, Misses: %i, Total: %i, Timeouts: %i, "
+	    "Unmatched replies: %lu, Kernel drops: %lu requests, %lu replies",
 						cache_hits, cache_misses, cache_hits + cache_misses, 
-						total_timeouts);
-		if (stats_reset)
+						total_timeouts, reply_unmatched, listen_drops,
+						upstream_drops);
+  log_msg(LOG_INFO, "Request batches: 1: %lu, 2-3: %lu, 4-7: %lu, "
+	    "8-15: %lu, 16-31: %lu, 32-63: %lu, 64: %lu",
+	    recv_batch_hist[0], recv_batch_hist[1], recv_batch_hist[2],
+	    recv_batch_hist[3], recv_batch_hist[4], recv_batch_hist[5],
+	    recv_batch_hist[6]);
+  log_msg(LOG_INFO, "Packets sent: %lu, failed: %lu, in %lu send calls, "
+	    "held back %lu times for a full socket, packet buffers: %lu",
+	    sendq_sent, sendq_errors, sendq_calls, sendq_full, pkt_allocs);
+  log_msg(LOG_INFO, "Queries: %i in use, %i at most, %lu from the heap "
+	    "beyond the %i in the slab, %lu retransmissions", query_inuse,
+	    query_peak, query_heap, query_slab_size, query_retransmits);
+  if (shared_sockets)
+    log_msg(LOG_INFO, "Upstream sockets: %i spare, %lu opened, %lu retired, "
+	      "%lu reused past their limit",
+	      upsock_spares(), upsock_opened, upsock_retired, upsock_starved);
+  if (shared_sockets)
+    log_msg(LOG_INFO, "Probes: %i waiting, %lu legs left to one when their "
+	      "query was answered, %lu answered, %lu timed out", probe_pending,
+	      probes_taken, probes_answered, probes_expired);
+  else
+    log_msg(LOG_INFO, "Legs closed when their query was answered: %lu",
+	    legs_dropped);
+  if (fanout == FANOUT_HEDGE)
+    log_msg(LOG_INFO, "Hedging: %lu hedges sent, %lu queries answered "
+	      "first by one", hedges_sent, hedge_wins);
+  if (coalesce_max)
+    log_msg(LOG_INFO, "Coalesced: %lu requests waited for another client's "
+	      "query, %lu found it full", coalesce_joined, coalesce_full);
+  if (admit_queue)
+    log_msg(LOG_INFO, "Admission queue: %i waiting, %i at most, "
+	      "%lu let through after %lu ms on average, %lu shed",
+	      admit_depth, admit_peak, admit_released,
+	      admit_released ? admit_waited / admit_released : 0, admit_shed);
+  if (lookup_threads)
+    log_msg(LOG_INFO, "Lookup threads: %lu requests handed over, %lu looked "
+	      "up here, %lu wakeups", lookup_handed, lookup_inline,
+	      lookup_wakeups);
+  if (busy_poll)
+    log_msg(LOG_INFO, "Busy poll: %lu polls found events, %lu were empty, "
+	      "slept %lu times", busy_useful, busy_empty, busy_sleeps);
+		if (stats_reset) {
 			cache_hits = cache_misses = total_timeouts = 0;
-  }  
+			listen_drops = upstream_drops = 0;
+			memset(recv_batch_hist, 0, sizeof(recv_batch_hist));
+			sendq_sent = sendq_errors = sendq_calls = 0;
+			sendq_full = 0;
+			reply_unmatched = upsock_opened = upsock_retired = 0;
+			upsock_starved = 0;
+			busy_useful = busy_empty = busy_sleeps = 0;
+			lookup_handed = lookup_inline = lookup_wakeups = 0;
+			coalesce_joined = coalesce_full = 0;
+			query_peak = query_inuse;
+			query_heap = query_retransmits = 0;
+			hedges_sent = hedge_wins = 0;
+			probes_taken = probes_answered = probes_expired = 0;
+			legs_dropped = 0;
+			admit_peak = admit_depth;
+			admit_released = admit_waited = admit_shed = 0;
+		}
+}
+
+
+
+int busy_poll = 0;
+unsigned long busy_useful = 0, busy_empty = 0, busy_sleeps = 0;
+
+void busy_poll_sock(int sock) {
+#ifdef SO_BUSY_POLL
+  if (busy_poll > 0
+      && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+		    sizeof(busy_poll)) < 0)
+    log_debug(2, "Couldn't set SO_BUSY_POLL: %s", strerror(errno));
+#endif
 }
 
+/* Wait for events. With --busy-poll the sockets are polled without
+   sleeping until something shows up or busy_poll usec have passed (or
+   the timeout, if that comes first). Only then do we sleep. */
+static int wait_events(event_t **ready, const struct timespec *tout,
+		       const sigset_t *sigmask) {
+  static const struct timespec zero = { 0, 0 };
+  long long start, budget;
+  int n;
+
+  if (busy_poll > 0) {
+    budget = busy_poll;
+    if (tout != NULL
+	&& (long long)tout->tv_sec * 1000000 + tout->tv_nsec / 1000 < budget)
+      budget = (long long)tout->tv_sec * 1000000 + tout->tv_nsec / 1000;
+    start = clock_usec();
+    do {
+      if ((n = event_wait(ready, EVENT_MAXREADY, &zero, sigmask)) != 0) {
+	if (n > 0) busy_useful++;
+	return n;
+      }
+      busy_empty++;
+    } while (clock_usec() - start < budget);
+    busy_sleeps++;
+  }
+  return event_wait(ready, EVENT_MAXREADY, tout, sigmask);
+}
 
+/* run cache_expire() from the timer wheel, as long as there is
+   anything in the cache */
+static void expire_cache(void *arg) {
+  cache_expire();
+  if (cache_empty()) timer_del(&cache_timer);
+}
+
+/* the tcp listener, as registered with the event loop */
+#ifdef ENABLE_TCP
+static event_t ev_tcpsock;
+#endif
 
 /*
  * run()
@@ -268,37 +421,42 @@ void query_stats(time_t interval) {
 void run()
 {
   struct timespec    tout;
-  fd_set             fdread;
-  int                retn;
+  event_t           *ready[EVENT_MAXREADY];
+  int                retn, i;
   sigset_t          orig_sigmask; 
 
-  FD_ZERO(&fdmaster);
-  FD_SET(isock,   &fdmaster);
+  if (event_init() < 0)
+    log_err_exit(-1, "Couldn't initialize the event loop");
+  listener_register();
 #ifdef ENABLE_TCP
-  FD_SET(tcpsock, &fdmaster);
-  maxsock = (tcpsock > isock) ? tcpsock : isock;
-#else
-  maxsock = isock;
+  if (event_add(&ev_tcpsock, tcpsock, EV_TCP, NULL, 0) < 0)
+    log_err_exit(-1, "tcpsock: Couldn't add to the event loop");
 #endif
+  upsock_register();
 
   init_sig_handler(&orig_sigmask);
+  lookup_start();
+
+  /* the server timeouts and reactivation, and the cache expiry, are
+     only set when there is something for them to do. Servers that are
+     already deactivated at startup are retried */
+  retry_servers();
+  if (stats_interval != 0)
+    timer_every(&query_stats_timer, MSEC(stats_interval), query_stats, NULL);
+  if (opt_debug >= 4)
+    timer_every(&srv_stats_timer, MSEC(10), srv_stats, NULL);
 
   while(1) {
-    query_t *q;
-    tout.tv_sec  = select_timeout;
-    tout.tv_nsec = 0;
-    fdread = fdmaster;
+    msec_t next = timer_next(clock_ms);
+
+    /* sleep until the next timer is due, or until something comes in
+       if no timer is set */
+    tout.tv_sec  = next / 1000;
+    tout.tv_nsec = (next % 1000) * 1000000;
     
     /* Wait for input or timeout */
-    retn = pselect(maxsock+1, &fdread, 0, 0, &tout, &orig_sigmask);
-    
-    /* reactivate servers */
-    if (reactivate_interval != 0) {
-      reactivate_servers(reactivate_interval);
-      /* check if any server should be timed out */
-      if (forward_timeout != 0)
-	deactivate_servers(1);
-    }
+    retn = wait_events(ready, next < 0 ? NULL : &tout, &orig_sigmask);
+    clock_update();
 
     /* Handle errors */
     if (retn < 0) {
@@ -308,62 +466,68 @@ void run()
     master_reinit();
 #endif
 	    } else {
-      log_msg(LOG_ERR, "select returned %s", strerror(errno));
+      log_msg(LOG_ERR, "event_wait returned %s", strerror(errno));
 	    }
       continue;
     }
-    else if (retn != 0) {
-      for (q = &qlist; q->next != &qlist; q = q->next) {
-	int i;
-	for(i=0; i<3; ++i)
-	{
-		if (FD_ISSET(q->next->sock_arr[i], &fdread)) {
-	  		udp_handle_reply(q, i);
-		}
-		
-		/* if it's a dummy query used for only reactivation, then break now, because dummy queries
-                 * only have a single valid socket.
-                 */
-		if (q->next->is_dummy == 1)
-			break;
-	}
-      }
 
+    /* The sockets are edge triggered so each one is read until it
+       would block */
+    for (i = 0; i < retn; i++) {
+      event_t *ev = ready[i];
+
+      /* the owner was destroyed by an earlier event in this round */
+      if (ev == NULL) continue;
+
+      switch (ev->type) {
+      case EV_QUERY: {
+	query_t *prev = query_prev((query_t *)ev->owner);
+	int idx = ev->idx;
+	while (udp_handle_reply(prev, idx) > 0);
+	break;
+      }
+      case EV_UPSTREAM:
+	while (udp_handle_upreply((upsock_t *)ev->owner) > 0);
+	break;
 #ifdef ENABLE_TCP
-      /* Check for incoming TCP requests */
-      if (FD_ISSET(tcpsock, &fdread)) tcp_handle_request();
+      case EV_TCP:
+	/* Check for incoming TCP requests */
+	tcp_handle_request();
+	break;
 #endif
-      /* Check for new DNS queries */
-      if (FD_ISSET(isock, &fdread)) {
-        q = udp_handle_request();
-	    if (q != NULL) {
-	    }
+      case EV_LISTEN:
+	/* Check for new DNS queries */
+	while (udp_handle_request((listener_t *)ev->owner) > 0);
+	break;
+      case EV_LOOKUP:
+	/* requests the lookup threads are through with */
+	lookup_collect();
+	break;
+      case EV_SENDQ:
+	sendq_writable((struct _sendq_wait *)ev->owner);
+	break;
       }
-    } else {
-      /* idle */
     }
     
     /* ok, we are done with replies and queries, lets do some
 	   maintenance work */
     
-    /* Expire lookups from the cache */
-    cache_expire();
-    /* Remove old unanswered queries */
-    query_timeout(20);
+    /* run the query timeouts and housekeeping jobs that are due */
+    timer_run(clock_ms);
+
+    /* let the queries through that waited for the ones that just
+       finished */
+    admit_release();
+    if (!timer_pending(&cache_timer) && !cache_empty())
+      timer_every(&cache_timer, MSEC(CACHE_MINCYCLE), expire_cache, NULL);
+
+    /* send the replies, and the queries through shared sockets,
+       collected during this round */
+    sendq_flush();
     
-    /* create new query/socket for next incomming request */
-    /* this did not make the program run any faster
-    d=domain_list;
-    do {
-      if ((s=d->srvlist)) 
-	while ((s=s->next) != d->srvlist)
-	  if (s->newquery == NULL) 
-	    s->newquery = query_get_new(d, s);
-    } while ((d=d->next) != domain_list);
-    */
-
-    /* print som query statestics */
-    query_stats(stats_interval);
-    srv_stats(10);
+    /* open the upstream sockets for the next incoming requests now,
+       rather than while a request waits for them */
+    upsock_refill();
+
   }
 }
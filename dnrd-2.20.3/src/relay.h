@@ -25,10 +25,33 @@
 #include <netinet/in.h>
 
 
+/* microseconds to poll for events before the loop goes to sleep,
+   0 to always sleep right away (--busy-poll) */
+extern int busy_poll;
+/* polls that found events and polls that didn't, and the times the
+   budget ran out */
+extern unsigned long busy_useful, busy_empty, busy_sleeps;
+
+/* let the kernel busy poll sock for busy_poll usec when it is read */
+void busy_poll_sock(int sock);
+
+/* make sure the servers are checked for timeouts forward_timeout
+   from now. Called when a server is sent to with nothing pending */
+void watch_servers(void);
+
+/* retry the inactive servers every reactivate_interval from now on,
+   until none are left */
+void retry_servers(void);
+
 /* The main loop */
 void run();
 
 /* Determine what to do with a DNS request */
 int handle_query(const struct sockaddr_in *fromaddrp, char *msg, int *len, infnode_t **inf); //domnode_t **dptr);
+/* the two halves of it: answer from the master database or the cache,
+   which any thread may do, and pick the server, which only the relay
+   loop may do */
+int classify_query(const struct sockaddr_in *fromaddrp, char *msg, int *len);
+int route_query(char *msg, int *len, infnode_t **inf);
 
 #endif  /* _DNRD_RELAY_H_ */
@@ -0,0 +1,401 @@
+/*
+ * sendq.c - batched sending of udp packets
+ *
+ * Replies to clients are not sent as soon as they are ready. They are
+ * collected during one round of the relay loop and written with as
+ * few sendmmsg() calls as possible when the round is over. With the
+ * io_uring backend they are queued in the ring instead.
+ *
+ * Queries to the servers go the same way when they are sent through
+ * the shared upstream sockets, where many of them use the same socket.
+ * Retransmissions and queries through a socket of their own are still
+ * sent at once, their result decides which server is tried next.
+ *
+ * When the kernel has no room for a packet the socket is full. Its
+ * packets are held back and sent once the socket can be written to
+ * again. Only packets that fail for some other reason are dropped.
+ *
+ * Replies from upstream are not copied. The slot holds a reference to
+ * the buffer they were received into and the client's qid goes out in
+ * an iovec of its own in front of the rest of the packet.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "common.h"
+#include "check.h"
+#include "event.h"
+#include "sendq.h"
+#include "pkt.h"
+
+unsigned long sendq_sent = 0;
+unsigned long sendq_errors = 0;
+unsigned long sendq_calls = 0;
+unsigned long sendq_full = 0;
+
+typedef struct {
+  int                sock;
+  struct sockaddr_in to;
+  int                len;
+  pkt_t             *pkt; /* sent from here if set, else from msg */
+  unsigned short     id;  /* the qid to send with pkt */
+  struct iovec       iov[2]; /* for packets handed to the event backend */
+  struct msghdr      mh;
+  char               msg[UDP_MAXSIZE+4];
+} sendq_pkt_t;
+
+/* A slot is busy from sendq_add() until its packet has been sent. With
+   the io_uring backend that is some time after sendq_flush(). */
+static sendq_pkt_t pkts[SENDQ_SLOTS];
+static int         free_slot[SENDQ_SLOTS];
+static int         nfree = -1; /* -1 until the free list is set up */
+
+/* slots waiting for sendq_flush(), in order */
+static int         queue[SENDQ_MAX];
+static int         queued = 0;
+
+/* A socket the kernel had no room on. It is registered for reading
+   already, so a copy of it is registered for writing */
+typedef struct _sendq_wait {
+  int     used;
+  int     sock;
+  event_t ev;
+} sendq_wait_t;
+
+static sendq_wait_t waits[SENDQ_WAITS];
+
+/* slots held back for a full socket, in order */
+static int         held[SENDQ_SLOTS];
+static int         nheld = 0;
+
+/* errors that only mean the socket is full for now */
+static int would_block(int err) {
+  return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+static void send_failed(sendq_pkt_t *p, int rc, int err) {
+  if (rc < 0)
+    log_debug(1, "sendto error %s: %s", inet_ntoa(p->to.sin_addr),
+	      strerror(err));
+  else
+    log_debug(1, "sendto error %s: sent %i of %i bytes",
+	      inet_ntoa(p->to.sin_addr), rc, p->len);
+  sendq_errors++;
+}
+
+/* point iov at the packet of p. Returns the number of iovecs used */
+static int slot_iov(sendq_pkt_t *p, struct iovec *iov) {
+  if (p->pkt == NULL) {
+    iov[0].iov_base = p->msg;
+    iov[0].iov_len = p->len;
+    return 1;
+  }
+  iov[0].iov_base = &p->id;
+  iov[0].iov_len = sizeof(p->id);
+  iov[1].iov_base = p->pkt->data + sizeof(p->id);
+  iov[1].iov_len = p->len - sizeof(p->id);
+  return 2;
+}
+
+static void slot_free(int slot) {
+  if (pkts[slot].pkt != NULL) {
+    pkt_put(pkts[slot].pkt);
+    pkts[slot].pkt = NULL;
+  }
+  free_slot[nfree++] = slot;
+}
+
+/* the wait for sock, NULL if it isn't full */
+static sendq_wait_t *wait_find(int sock) {
+  int i;
+
+  for (i = 0; i < SENDQ_WAITS; i++)
+    if (waits[i].used && waits[i].sock == sock) return &waits[i];
+  return NULL;
+}
+
+/* wait until sock can be written to. Returns -1 if we can't */
+static int wait_start(int sock) {
+  sendq_wait_t *w = NULL;
+  int i, fd;
+
+  if (wait_find(sock) != NULL) return 0;
+  for (i = 0; i < SENDQ_WAITS && w == NULL; i++)
+    if (!waits[i].used) w = &waits[i];
+  if (w == NULL || (fd = dup(sock)) < 0) return -1;
+  if (event_add(&w->ev, fd, EV_SENDQ, w, 0) < 0) {
+    close(fd);
+    return -1;
+  }
+  w->sock = sock;
+  w->used = 1;
+  sendq_full++;
+  return 0;
+}
+
+static void wait_end(sendq_wait_t *w) {
+  event_del(&w->ev);
+  close(w->ev.fd);
+  w->used = 0;
+}
+
+/* hold slot back until its socket can take it. If it can't be waited
+   for it is dropped */
+static void hold(int slot) {
+  if (wait_start(pkts[slot].sock) == 0) {
+    held[nheld++] = slot;
+    return;
+  }
+  send_failed(&pkts[slot], -1, EAGAIN);
+  slot_free(slot);
+}
+
+/* send the packets in the slots list[0..n-1], which all use the same
+   socket. Returns how many are done with, sent or failed. The rest
+   didn't fit in the socket */
+static int send_run(int *list, int n) {
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr mmsg[SENDQ_MAX];
+  struct iovec   iov[SENDQ_MAX][2];
+  int            i, rc;
+
+  memset(mmsg, 0, sizeof(struct mmsghdr) * n);
+  for (i = 0; i < n; i++) {
+    sendq_pkt_t *p = &pkts[list[i]];
+    mmsg[i].msg_hdr.msg_iov = iov[i];
+    mmsg[i].msg_hdr.msg_iovlen = slot_iov(p, iov[i]);
+    mmsg[i].msg_hdr.msg_name = &p->to;
+    mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  i = 0;
+  while (i < n) {
+    sendq_calls++;
+    rc = sendmmsg(pkts[list[0]].sock, &mmsg[i], n - i, 0);
+    if (rc <= 0) {
+      if (rc < 0 && errno == EINTR) continue;
+      if (rc < 0 && would_block(errno)) return i;
+      /* the packet at i could not be sent; skip it and go on */
+      send_failed(&pkts[list[i]], -1, errno);
+      i++;
+      continue;
+    }
+    for (; rc > 0; rc--, i++) {
+      if ((int)mmsg[i].msg_len != pkts[list[i]].len)
+	send_failed(&pkts[list[i]], mmsg[i].msg_len, 0);
+      else
+	sendq_sent++;
+    }
+  }
+  return n;
+#else
+  struct msghdr mh;
+  struct iovec  iov[2];
+  int i, rc;
+
+  for (i = 0; i < n; i++) {
+    sendq_pkt_t *p = &pkts[list[i]];
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &p->to;
+    mh.msg_namelen = sizeof(struct sockaddr_in);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = slot_iov(p, iov);
+    sendq_calls++;
+    rc = sendmsg(p->sock, &mh, 0);
+    if (rc < 0 && would_block(errno))
+      return i;
+    if (rc != p->len)
+      send_failed(p, rc, errno);
+    else
+      sendq_sent++;
+  }
+  return n;
+#endif
+}
+
+void sendq_flush(void) {
+  int list[SENDQ_SLOTS];
+  int first, i, n = 0, kept = 0;
+
+  /* what was held back for a socket that can take it again goes
+     first. New packets for a socket that is still full wait behind
+     the ones held for it */
+  for (i = 0; i < nheld; i++)
+    if (wait_find(pkts[held[i]].sock) != NULL) held[kept++] = held[i];
+    else list[n++] = held[i];
+  nheld = kept;
+  for (i = 0; i < queued; i++)
+    if (wait_find(pkts[queue[i]].sock) != NULL) hold(queue[i]);
+    else list[n++] = queue[i];
+  queued = 0;
+
+  /* hand them to the event backend if it sends on its own */
+  for (first = 0; first < n; first++) {
+    sendq_pkt_t *p = &pkts[list[first]];
+    memset(&p->mh, 0, sizeof(p->mh));
+    p->mh.msg_name = &p->to;
+    p->mh.msg_namelen = sizeof(struct sockaddr_in);
+    p->mh.msg_iov = p->iov;
+    p->mh.msg_iovlen = slot_iov(p, p->iov);
+    if (event_sendmsg(p->sock, &p->mh, list[first]) < 0) break;
+  }
+
+  /* and send the rest ourselves */
+  for (i = first; first < n; first = i) {
+    int sock = pkts[list[first]].sock, done = 0;
+    for (i = first + 1; i < n && i - first < SENDQ_MAX
+	   && pkts[list[i]].sock == sock; i++);
+    if (wait_find(sock) == NULL)
+      done = send_run(&list[first], i - first);
+    while (done--) slot_free(list[first++]);
+    while (first < i) hold(list[first++]);
+  }
+}
+
+void sendq_done(int slot, int res) {
+  if (res < 0 && would_block(-res)) {
+    hold(slot);
+    return;
+  }
+  if (res != pkts[slot].len)
+    send_failed(&pkts[slot], res, -res);
+  else
+    sendq_sent++;
+  slot_free(slot);
+}
+
+void sendq_writable(sendq_wait_t *w) {
+  /* the packets held for it go out with the next sendq_flush() */
+  wait_end(w);
+}
+
+void sendq_forget(int sock) {
+  sendq_wait_t *w;
+  int i, kept;
+
+  /* what is still waiting for it is dropped */
+  for (i = 0, kept = 0; i < queued; i++)
+    if (pkts[queue[i]].sock != sock) queue[kept++] = queue[i];
+    else {
+      sendq_errors++;
+      slot_free(queue[i]);
+    }
+  queued = kept;
+  for (i = 0, kept = 0; i < nheld; i++)
+    if (pkts[held[i]].sock != sock) held[kept++] = held[i];
+    else {
+      sendq_errors++;
+      slot_free(held[i]);
+    }
+  nheld = kept;
+  if ((w = wait_find(sock)) != NULL) wait_end(w);
+}
+
+/* queue a slot for sock/to, or NULL if every slot is still on its way
+   out. The caller fills in the packet */
+static sendq_pkt_t *slot_add(int sock, const struct sockaddr_in *to,
+			     int len) {
+  sendq_pkt_t *p;
+  int i;
+
+  if (nfree < 0)
+    for (nfree = 0, i = SENDQ_SLOTS - 1; i >= 0; i--)
+      free_slot[nfree++] = i;
+  if (queued == SENDQ_MAX || nfree == 0) sendq_flush();
+  if (nfree == 0) return NULL;
+
+  queue[queued] = free_slot[--nfree];
+  p = &pkts[queue[queued++]];
+  p->sock = sock;
+  memcpy(&p->to, to, sizeof(struct sockaddr_in));
+  p->len = len;
+  return p;
+}
+
+/* send p right away, for when no slot is free. There is no room to
+   hold it back either, so if its socket is full we wait for it */
+static void send_now(sendq_pkt_t *p) {
+  struct msghdr mh;
+  struct iovec  iov[2];
+  struct pollfd pfd;
+  int rc;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = &p->to;
+  mh.msg_namelen = sizeof(struct sockaddr_in);
+  mh.msg_iov = iov;
+  mh.msg_iovlen = slot_iov(p, iov);
+  sendq_calls++;
+  if ((rc = sendmsg(p->sock, &mh, 0)) < 0 && would_block(errno)) {
+    pfd.fd = p->sock;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, SENDQ_BLOCK_MS) > 0) {
+      sendq_calls++;
+      rc = sendmsg(p->sock, &mh, 0);
+    }
+  }
+  if (rc != p->len)
+    send_failed(p, rc, errno);
+  else
+    sendq_sent++;
+}
+
+void sendq_add(int sock, const struct sockaddr_in *to, const void *msg,
+	       int len) {
+  sendq_pkt_t *p, tmp;
+
+  if (len > UDP_MAXSIZE + 4) {
+    log_debug(1, "sendq: dropping %i byte packet", len);
+    sendq_errors++;
+    return;
+  }
+  if ((p = slot_add(sock, to, len)) == NULL) {
+    tmp.sock = sock;
+    memcpy(&tmp.to, to, sizeof(struct sockaddr_in));
+    tmp.len = len;
+    tmp.pkt = NULL;
+    memcpy(tmp.msg, msg, len);
+    send_now(&tmp);
+    return;
+  }
+  memcpy(p->msg, msg, len);
+}
+
+void sendq_add_pkt(int sock, const struct sockaddr_in *to, pkt_t *pkt,
+		   unsigned short id) {
+  sendq_pkt_t *p, tmp;
+
+  if (pkt->len < (int)sizeof(id)) return;
+  if ((p = slot_add(sock, to, pkt->len)) == NULL) p = &tmp;
+  p->pkt = pkt;
+  p->id = id;
+  if (p == &tmp) {
+    send_now(p);
+    return;
+  }
+  pkt_ref(pkt);
+}
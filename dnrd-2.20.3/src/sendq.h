@@ -0,0 +1,85 @@
+/*
+ * sendq.h - batched sending of udp packets
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_SENDQ_H_
+#define _DNRD_SENDQ_H_
+
+#include <netinet/in.h>
+#include "pkt.h"
+
+/* max number of packets held back before the queue is flushed */
+#ifndef SENDQ_MAX
+#define SENDQ_MAX 64
+#endif
+
+/* max number of full sockets waited for at a time */
+#ifndef SENDQ_WAITS
+#define SENDQ_WAITS 8
+#endif
+
+/* how long a packet waits for a full socket when every buffer is in
+   use, ms */
+#ifndef SENDQ_BLOCK_MS
+#define SENDQ_BLOCK_MS 100
+#endif
+
+/* packet buffers, including those the event backend is still sending */
+#ifndef SENDQ_SLOTS
+#define SENDQ_SLOTS (4 * SENDQ_MAX)
+#endif
+
+/* packets sent, replies and queries, and packets that failed, since
+   the last stats reset */
+extern unsigned long sendq_sent;
+extern unsigned long sendq_errors;
+/* number of send system calls used for them */
+extern unsigned long sendq_calls;
+/* times a socket was full and its packets were held back */
+extern unsigned long sendq_full;
+
+/* Queue a copy of msg for sock/to. The packet goes out with the next
+ * sendq_flush(), or right away if the queue is full. */
+void sendq_add(int sock, const struct sockaddr_in *to, const void *msg,
+	       int len);
+
+/* Queue pkt for sock/to with id as its qid, which is in network byte
+ * order. A reference to pkt is kept until it has been sent, the buffer
+ * itself is not changed. */
+void sendq_add_pkt(int sock, const struct sockaddr_in *to, pkt_t *pkt,
+		   unsigned short id);
+
+/* Send everything queued. Consecutive packets for the same socket go
+ * out with one sendmmsg() call. Packets for a socket that is full are
+ * held back until it can be written to. Each failed packet is logged
+ * on its own and counted in sendq_errors. */
+void sendq_flush(void);
+
+/* called by the relay loop when a full socket can be written to
+   again (EV_SENDQ) */
+struct _sendq_wait;
+void sendq_writable(struct _sendq_wait *w);
+
+/* drop what is queued for sock. Call this before closing it */
+void sendq_forget(int sock);
+
+/* called by the event backend when it has sent the packet in slot.
+   res is the number of bytes sent or -errno. A packet the socket had
+   no room for is held back like the others */
+void sendq_done(int slot, int res);
+
+#endif /* _DNRD_SENDQ_H_ */
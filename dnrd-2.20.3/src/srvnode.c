@@ -30,6 +30,8 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/mman.h>
 
 #include "srvnode.h"
 #include "lib.h"
@@ -81,7 +83,7 @@ srvnode_t *destroy_srvnode(srvnode_t *p) {
   /* close socket */
   assert(p!=NULL);
   /*  if (p->sock) close(p->sock); */
-  free(p);
+  if (!p->shared) free(p);
   return NULL;
 }
 
@@ -99,7 +101,7 @@ srvnode_t *clear_srvlist(srvnode_t *head) {
 srvnode_t *destroy_srvlist(srvnode_t *head) {
   assert(head != NULL);
   clear_srvlist(head);
-  free(head);
+  destroy_srvnode(head);
   return NULL;
 }
 
@@ -139,3 +141,31 @@ int no_srvlist(srvnode_t *head) {
   return (head->next == head);
 }
 
+/* Move the server list, including the head, to memory that is shared
+ * with processes forked later on. A server that one worker deactivates
+ * is then seen as inactive by all of them. The list must not be
+ * changed after this.
+ * Returns the new head. */
+srvnode_t *share_srvlist(srvnode_t *head) {
+  srvnode_t *arena, *p, *q;
+  int n = 1, i;
+
+  assert(head != NULL);
+  for (p = head->next; p != head; p = p->next) n++;
+
+  arena = mmap(NULL, n * sizeof(srvnode_t), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+    log_err_exit(-1, "Couldn't map shared server list: %s",
+		 strerror(errno));
+
+  for (i = 0, p = head; i < n; i++) {
+    q = p->next;
+    memcpy(&arena[i], p, sizeof(srvnode_t));
+    arena[i].shared = 1;
+    arena[i].next = &arena[(i + 1) % n];
+    destroy_srvnode(p);
+    p = q;
+  }
+  return arena;
+}
@@ -26,14 +26,18 @@
 #define SRVNODE_H
 
 #include <netinet/in.h>
+#include "clock.h"
 
 typedef struct _srvnode {
   /*  int                 sock;*/ /* the communication socket */
   struct sockaddr_in  addr;      /* IP address of server */
   time_t              inactive; /* is this server active? */
   unsigned int        send_count;
-  int                 send_time;
+  msec_t              send_time; /* first send since the last reply */
+  int                 srtt;     /* smoothed round trip time, ms. 0 if unknown */
+  int                 rttvar;   /* and its mean deviation */
   int                 tcp;
+  int                 shared;   /* lives in memory shared by the workers */
   struct _query   *newquery; /* new opened socket, prepared for a new query */
   struct _srvnode     *next; /* ptr to next server */
 } srvnode_t;
@@ -49,6 +53,7 @@ srvnode_t *destroy_srvlist(srvnode_t *head);
 srvnode_t *add_srv(srvnode_t *head, const char *ipaddr);
 srvnode_t *last_srvnode(srvnode_t *head);
 int no_srvlist(srvnode_t *head);
+srvnode_t *share_srvlist(srvnode_t *head);
 
 
 #endif
@@ -0,0 +1,220 @@
+/*
+ * timer.c - timer wheel for query deadlines and periodic jobs
+ *
+ * A hierarchical timing wheel. The first level has a slot per
+ * millisecond for the next 256 ms, the levels above it cover 64 times
+ * as much each (16 seconds, 17 minutes and 18 hours) and are moved
+ * down a level as the time comes closer.
+ * Setting and deleting a timer is O(1), and a run only touches the
+ * timers that expire (and those moved down a level). Stretches of time
+ * without anything to do are skipped, so a long sleep costs nothing.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <stddef.h>
+
+#include "timer.h"
+
+#define ROOT_BITS  8
+#define LEVEL_BITS 6
+#define LEVELS     3 /* above the root */
+#define ROOT_SIZE  (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK  (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+/* the first ms that doesn't fit in the wheel */
+#define WHEEL_SPAN ((msec_t)1 << (ROOT_BITS + LEVELS * LEVEL_BITS))
+
+/* the slots are circular lists with the slot itself as head */
+static tmr_t root[ROOT_SIZE];
+static tmr_t level[LEVELS][LEVEL_SIZE];
+static int   initialized = 0;
+static int   count = 0;  /* timers set */
+static msec_t wheel_now; /* the next ms to run */
+
+static void list_init(tmr_t *head) {
+  head->next = head->prev = head;
+}
+
+static void wheel_init(msec_t now) {
+  int i, l;
+
+  for (i = 0; i < ROOT_SIZE; i++) list_init(&root[i]);
+  for (l = 0; l < LEVELS; l++)
+    for (i = 0; i < LEVEL_SIZE; i++) list_init(&level[l][i]);
+  wheel_now = now;
+  initialized = 1;
+}
+
+/* put t in the slot for its expiry time */
+static void insert(tmr_t *t) {
+  msec_t when = t->expires, delta;
+  tmr_t *head;
+  int l;
+
+  if (when < wheel_now) when = wheel_now;
+  delta = when - wheel_now;
+
+  if (delta < ROOT_SIZE) {
+    head = &root[when & ROOT_MASK];
+  } else {
+    /* too far out for the wheel; park it in the last slot and
+       look again when that slot comes down */
+    if (delta >= WHEEL_SPAN) when = wheel_now + WHEEL_SPAN - 1;
+    for (l = 0; l < LEVELS - 1; l++)
+      if (when - wheel_now < (msec_t)1 << (ROOT_BITS + (l+1) * LEVEL_BITS))
+	break;
+    head = &level[l][(when >> (ROOT_BITS + l * LEVEL_BITS)) & LEVEL_MASK];
+  }
+
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void unlink_timer(tmr_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+/* move the timers of a slot one level down (or to their own slot) */
+static void cascade(tmr_t *head) {
+  tmr_t *t;
+
+  while ((t = head->next) != head) {
+    unlink_timer(t);
+    insert(t);
+  }
+}
+
+void timer_set(tmr_t *t, msec_t when, void (*fn)(void *), void *arg) {
+  if (!initialized) wheel_init(clock_ms);
+  if (t->next) unlink_timer(t);
+  else count++;
+  t->expires = when;
+  t->period = 0;
+  t->fn = fn;
+  t->arg = arg;
+  insert(t);
+}
+
+void timer_every(tmr_t *t, msec_t period, void (*fn)(void *), void *arg) {
+  timer_set(t, clock_ms + period, fn, arg);
+  t->period = period;
+}
+
+void timer_del(tmr_t *t) {
+  if (t->next == NULL) return;
+  unlink_timer(t);
+  count--;
+}
+
+/* the first ms from wheel_now on that has timers in the root or a
+   slot to move down, -1 if no timer is set. Nothing happens before it */
+static msec_t next_due(void) {
+  msec_t s, t, step, due = -1;
+  tmr_t *head;
+  int l, j;
+
+  if (count == 0) return -1;
+
+  for (s = wheel_now; s < wheel_now + ROOT_SIZE; s++) {
+    head = &root[s & ROOT_MASK];
+    if (head->next != head) {
+      due = s;
+      break;
+    }
+  }
+
+  /* a slot above the root is moved down at the start of its stretch */
+  for (l = 0; l < LEVELS; l++) {
+    int shift = ROOT_BITS + l * LEVEL_BITS;
+    step = (msec_t)1 << shift;
+    t = (wheel_now + step - 1) & ~(step - 1);
+    for (j = 0; j < LEVEL_SIZE && (due < 0 || t < due); j++, t += step) {
+      head = &level[l][(t >> shift) & LEVEL_MASK];
+      if (head->next != head) {
+	due = t;
+	break;
+      }
+    }
+  }
+  return due;
+}
+
+void timer_run(msec_t now) {
+  tmr_t *head, *t, expired;
+  msec_t due;
+  int l;
+
+  if (!initialized) return;
+
+  while (wheel_now <= now) {
+    /* skip ahead to the next thing to do */
+    if ((due = next_due()) < 0 || due > now) {
+      wheel_now = now + 1;
+      break;
+    }
+    wheel_now = due;
+
+    /* bring the next stretch of time down to the root */
+    for (l = 0; l < LEVELS; l++) {
+      int shift = ROOT_BITS + l * LEVEL_BITS;
+      if ((wheel_now & (((msec_t)1 << shift) - 1)) != 0)
+	break;
+      cascade(&level[l][(wheel_now >> shift) & LEVEL_MASK]);
+    }
+
+    /* take the slot out of the wheel first, a periodic timer may go
+       right back into it */
+    head = &root[wheel_now & ROOT_MASK];
+    wheel_now++;
+    if (head->next == head) continue;
+    expired.next = head->next;
+    expired.prev = head->prev;
+    expired.next->prev = expired.prev->next = &expired;
+    list_init(head);
+
+    /* fn may set or delete any timer, including this one */
+    while ((t = expired.next) != &expired) {
+      unlink_timer(t);
+      count--;
+      if (t->period) {
+	t->expires = now + t->period;
+	insert(t);
+	count++;
+      }
+      t->fn(t->arg);
+    }
+  }
+}
+
+msec_t timer_next(msec_t now) {
+  msec_t due;
+
+  if (!initialized || (due = next_due()) < 0) return -1;
+  return due > now ? due - now : 0;
+}
+
+int timer_pending(const tmr_t *t) {
+  return t->next != NULL;
+}
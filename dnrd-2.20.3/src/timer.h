@@ -0,0 +1,54 @@
+/*
+ * timer.h - timer wheel for query deadlines and periodic jobs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_TIMER_H_
+#define _DNRD_TIMER_H_
+
+#include "clock.h"
+
+/* A timer. It is embedded in its owner and must be zeroed (or
+ * deleted) before it is set the first time. */
+typedef struct _tmr {
+  msec_t        expires; /* when fn is called, in clock_ms time */
+  msec_t        period;  /* set again this much later, 0 for once */
+  void        (*fn)(void *arg);
+  void         *arg;
+  struct _tmr  *next;    /* in the wheel slot, NULL when not set */
+  struct _tmr  *prev;
+} tmr_t;
+
+/* call fn(arg) at time when. A timer that is already set is moved */
+void timer_set(tmr_t *t, msec_t when, void (*fn)(void *), void *arg);
+
+/* call fn(arg) every period ms, the first time period from now */
+void timer_every(tmr_t *t, msec_t period, void (*fn)(void *), void *arg);
+
+/* stop a timer. It is ok to delete a timer that isn't set */
+void timer_del(tmr_t *t);
+
+/* run the timers that have expired by now */
+void timer_run(msec_t now);
+
+/* ms from now to the next deadline, -1 if no timer is set. It can be
+   early when timers far out are moved closer, never late */
+msec_t timer_next(msec_t now);
+
+/* is t set? */
+int timer_pending(const tmr_t *t);
+
+#endif /* _DNRD_TIMER_H_ */
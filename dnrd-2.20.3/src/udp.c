@@ -33,17 +33,35 @@
 #include <assert.h>
 #include <stdio.h>
 #include <sys/param.h>
+#include <limits.h>
 #include "common.h"
 #include "relay.h"
 #include "cache.h"
 #include "query.h"
 #include "check.h"
 #include "dns.h"
+#include "udp.h"
+#include "sendq.h"
+#include "upsock.h"
+#include "clock.h"
+#include "pkt.h"
+#include "listener.h"
+#include "admit.h"
+#include "lookup.h"
+#include "probe.h"
 
 #ifndef EXCLUDE_MASTER
 #include "master.h"
 #endif
 
+static int handle_reply(query_t *prev, int leg, srvnode_t *srv, pkt_t *p);
+static void probe_reply(probe_t *pr, srvnode_t *srv, pkt_t *p);
+static void handle_verdict(int sock, char *msg, int fwd, int len,
+			   struct sockaddr_in *from_addr, int admitted);
+
+/* number of recvmmsg() batches seen, by size */
+unsigned long recv_batch_hist[RECV_HIST_SIZE];
+
 /* TEMP matched special host array of interfaces */
 char matched_intf[5][10];
 int matched_intf_cnt;
@@ -60,7 +78,6 @@ int matched_intf_cnt;
 static int udp_send(int sock, srvnode_t *srv, void *msg, int len)
 {
     int	rc;
-    time_t now = time(NULL);
     rc = sendto(sock, msg, len, 0,
 		(const struct sockaddr *) &srv->addr,
 		sizeof(struct sockaddr_in));
@@ -70,7 +87,10 @@ static int udp_send(int sock, srvnode_t *srv, void *msg, int len)
 		inet_ntoa(srv->addr.sin_addr), strerror(errno));
 	return (rc);
     }
-    if ((srv->send_time == 0)) srv->send_time = now;
+    if ((srv->send_time == 0)) {
+	srv->send_time = clock_ms;
+	watch_servers();
+    }
     srv->send_count++;
     
     log_msg(LOG_NOTICE, "Request forwarded to DNS server %s", inet_ntoa(srv->addr.sin_addr));
@@ -78,6 +98,82 @@ static int udp_send(int sock, srvnode_t *srv, void *msg, int len)
     return (rc);
 }
 
+/* like udp_send(), but the packet goes out with the send queue when
+ * the round of the relay loop is over. A failed send is only logged
+ * and counted there. */
+static void udp_queue(int sock, srvnode_t *srv, void *msg, int len)
+{
+    sendq_add(sock, &srv->addr, msg, len);
+    if ((srv->send_time == 0)) {
+	srv->send_time = clock_ms;
+	watch_servers();
+    }
+    srv->send_count++;
+
+    log_msg(LOG_NOTICE, "Request forwarded to DNS server %s", inet_ntoa(srv->addr.sin_addr));
+}
+
+int listen_rcvbuf = 0, listen_sndbuf = 0;
+int upstream_rcvbuf = 0, upstream_sndbuf = 0;
+unsigned long reply_unmatched = 0;
+unsigned long hedges_sent = 0, hedge_wins = 0;
+unsigned long legs_dropped = 0;
+unsigned long listen_drops = 0, upstream_drops = 0;
+
+/* set one of the buffer sizes of sock. Root may go past the rmem_max
+   and wmem_max limits */
+static void set_buffer(int sock, int opt, int force, int size, char *name)
+{
+    int got;
+    socklen_t len = sizeof(got);
+
+    if (size <= 0) return;
+#ifdef SO_RCVBUFFORCE
+    if (setsockopt(sock, SOL_SOCKET, force, &size, sizeof(size)) < 0)
+#endif
+	if (setsockopt(sock, SOL_SOCKET, opt, &size, sizeof(size)) < 0)
+	    log_debug(1, "Couldn't set %s to %i: %s", name, size,
+		      strerror(errno));
+    /* linux doubles it for its own bookkeeping */
+    if (getsockopt(sock, SOL_SOCKET, opt, &got, &len) == 0 && got < size)
+	log_debug(1, "%s is %i, not %i", name, got, size);
+}
+
+void udp_sock_setup(int sock, int rcvbuf, int sndbuf)
+{
+#ifdef SO_RXQ_OVFL
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+#endif
+#ifdef SO_RCVBUFFORCE
+    set_buffer(sock, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf, "SO_RCVBUF");
+    set_buffer(sock, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf, "SO_SNDBUF");
+#else
+    set_buffer(sock, SO_RCVBUF, 0, rcvbuf, "SO_RCVBUF");
+    set_buffer(sock, SO_SNDBUF, 0, sndbuf, "SO_SNDBUF");
+#endif
+}
+
+/* the kernel's drop count of a socket comes with every packet read
+   from it. Returns how many packets were dropped since *seen */
+static unsigned long count_drops(struct msghdr *mh, unsigned int *seen)
+{
+#ifdef SO_RXQ_OVFL
+    struct cmsghdr *cmsg;
+    unsigned int n, d;
+
+    if (mh->msg_controllen == 0) return 0;
+    for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+	    memcpy(&n, CMSG_DATA(cmsg), sizeof(n));
+	    d = n - *seen;
+	    *seen = n;
+	    return d;
+	}
+#endif
+    return 0;
+}
+
 int bind_sock2inf(int sock, char *inf_name)
 {
     int status = -1;
@@ -106,6 +202,211 @@ int is_curr_inf_default(char *i_name)
 	return 0;
 }
 
+/* the next active server of i after s, or s if there is no other */
+static srvnode_t *other_server(infnode_t *i, srvnode_t *s)
+{
+    srvnode_t *n;
+
+    for (n = s->next; n != s; n = n->next)
+	if (n != i->srvlist && !n->inactive) return n;
+    return s;
+}
+
+/* how long to wait for leg c of q before its next try: the RTO of the
+   server, doubled for every try after the first */
+static msec_t leg_rto(query_t *q, int c)
+{
+    srvnode_t *s = q->srv_list[c];
+    msec_t rto = s->srtt ? s->srtt + 4 * s->rttvar : RTO_INIT;
+
+    if (rto < RTO_MIN) rto = RTO_MIN;
+    rto <<= q->tries[c] - 1;
+    if (forward_timeout > 0 && rto > forward_timeout) rto = forward_timeout;
+    return rto;
+}
+
+/* can leg c of q be sent again? */
+static int leg_retry(query_t *q, int c)
+{
+    return (q->legs_out & (1 << c)) && q->srv_list[c] != NULL
+	&& q->tries[c] <= forward_retries;
+}
+
+static void retransmit(void *arg);
+
+/* set the retransmission timer of q for the leg that is due first */
+static void arm_retransmit(query_t *q)
+{
+    msec_t when = -1, t;
+    int c;
+
+    for (c = 0; c < q->npaths; c++)
+	if (leg_retry(q, c)
+	    && ((t = q->sent[c] + leg_rto(q, c)) < when || when < 0))
+	    when = t;
+    if (when < 0) timer_del(&q->rtx_timer);
+    else timer_set(&q->rtx_timer, when, retransmit, q);
+}
+
+/* send the legs of q again that haven't been answered in time */
+static void retransmit(void *arg)
+{
+    query_t *q = (query_t *)arg;
+    srvnode_t *s;
+    int c;
+
+    for (c = 0; c < q->npaths; c++) {
+	if (!leg_retry(q, c) || clock_ms < q->sent[c] + leg_rto(q, c))
+	    continue;
+	/* the first retry goes to the same server, the packet may just
+	   have been lost. Later ones to the next server of the interface */
+	s = q->srv_list[c];
+	if (q->tries[c] > 1)
+	    s = q->srv_list[c] = other_server(q->inf_list[c], s);
+	q->sent[c] = clock_ms;
+	log_debug(2, "Sending query %i to %s again, try %i", q->my_qid,
+		  inet_ntoa(s->addr.sin_addr), q->tries[c] + 1);
+	if (udp_send(q->sock_arr[c], s, q->qpkt->data, q->qpkt->len)
+	    != q->qpkt->len) {
+	    /* not a try. The next one goes to another server, after one
+	       more rto */
+	    if (reactivate_interval && s == q->inf_list[c]->current)
+		deactivate_current(q->inf_list[c]);
+	    q->srv_list[c] = other_server(q->inf_list[c], s);
+	    continue;
+	}
+	q->tried[c] |= server_bit(q->inf_list[c], s);
+	q->tries[c]++;
+	query_retransmits++;
+    }
+    arm_retransmit(q);
+}
+
+/* send leg c of q through its interface, to the current server */
+static void send_leg(query_t *q, int c, void *msg, int len)
+{
+    infnode_t *i = q->inf_list[c];
+
+	  /* shared sockets are already bound to their interface. A leg
+	     keeps the one it was first sent through while it is in use,
+	     the replies to earlier sends are matched by it */
+	  if (shared_sockets) {
+		  if (q->tries[c] == 0 || q->sock_arr[c] < 0
+		      || !upsock_live(i, q->sock_arr[c]))
+			  q->sock_arr[c] = upsock_get(i);
+	  }
+	  else {
+		  log_debug(3, "Binding to interface %s", i->inf);
+		  bind_sock2inf(q->sock_arr[c],i->inf);
+	  }
+
+	  /* the legs going through shared sockets are batched with the
+	     replies. Their send can't fail over to the next server, a
+	     server that doesn't get them times out instead */
+	  if (shared_sockets) {
+		  if (i->current != NULL)
+			  udp_queue(q->sock_arr[c], i->current, msg, len);
+	  }
+	  /* Try sending if current server is not null. Break as soon as current message is successfully sent. */
+	  else while ((i->current != NULL) && (udp_send(q->sock_arr[c], i->current, msg, len) != len)) {
+	  if (reactivate_interval)
+		  deactivate_current(i);
+	  }
+
+    /* Store pointer to server to which we sent request. A leg sent again
+       for the client keeps the servers it was sent to before, and the
+       reply may be to any of the tries */
+    if(i->current != NULL)
+    {
+    	if (q->tries[c] == 0) q->tried[c] = 0;
+    	q->tried[c] |= server_bit(i, i->current);
+    	q->srv_list[c] = i->current;
+    	q->sent[c] = clock_ms;
+    	q->tries[c]++;
+    	//printf("Server to which we sent %s\n", inet_ntoa(q->srv_list[c]->addr.sin_addr));
+    }
+
+    /* Keep track of how many servers this query has been sent to. This will be used to decide when to delete the query.
+     * A leg that is sent again before it is answered is only counted once. */
+    if (!(q->legs_out & (1 << c))) {
+    	q->serv_sent_cnt++;
+    	q->legs_out |= 1 << c;
+    }
+}
+
+/* the rank of a path: the smoothed rtt of its server, the unknown last */
+static int path_rank(infnode_t *i)
+{
+    if (i->current == NULL) return INT_MAX;
+    return i->current->srtt ? i->current->srtt : INT_MAX - 1;
+}
+
+/* put the paths of q in the order they are tried with --fanout=hedge */
+static void rank_paths(query_t *q)
+{
+    infnode_t *t;
+    int a, b;
+
+    for (a = 1; a < q->npaths; a++)
+	for (b = a; b > 0 && path_rank(q->inf_list[b]) < path_rank(q->inf_list[b-1]); b--) {
+	    t = q->inf_list[b];
+	    q->inf_list[b] = q->inf_list[b-1];
+	    q->inf_list[b-1] = t;
+	}
+}
+
+/* the path of q to hedge with next, -1 if there is none */
+static int hedge_next(query_t *q)
+{
+    int c;
+
+    if (fanout != FANOUT_HEDGE || q->resp_sent) return -1;
+    for (c = 1; c < q->npaths; c++)
+	if (!(q->legs_out & (1 << c)) && q->tries[c] == 0)
+	    return c;
+    return -1;
+}
+
+/* how long a path is given before the next one is tried: about the
+   90th percentile of its server's rtt. At once if that isn't known */
+static msec_t hedge_delay(srvnode_t *s)
+{
+    msec_t d;
+
+    if (s == NULL || s->srtt == 0) return 0;
+    d = s->srtt + 2 * s->rttvar;
+    return d < HEDGE_MIN ? HEDGE_MIN : d;
+}
+
+static void hedge(void *arg);
+
+/* set the hedge timer of q for its next path */
+static void arm_hedge(query_t *q)
+{
+    int c = hedge_next(q);
+
+    if (c < 0) timer_del(&q->hedge_timer);
+    else timer_set(&q->hedge_timer,
+		   q->sent[c-1] + hedge_delay(q->srv_list[c-1]), hedge, q);
+}
+
+/* send q through its next path, the ones before it haven't answered */
+static void hedge(void *arg)
+{
+    query_t *q = (query_t *)arg;
+    int c;
+
+    if ((c = hedge_next(q)) < 0) return;
+    /* a path without a server counts as tried at once */
+    if (q->srv_list[c-1] == NULL) q->sent[c-1] = clock_ms;
+    send_leg(q, c, q->qpkt->data, q->qpkt->len);
+    q->hedges |= 1 << c;
+    hedges_sent++;
+    log_debug(3, "Hedging query %i on %s", q->my_qid, q->inf_list[c]->inf);
+    arm_retransmit(q);
+    arm_hedge(q);
+}
+
 int send2current(query_t *q, void *msg, const int len) {
     /* If we have interface associated with our servers, send it to the
        appropriate server as determined by srvr */
@@ -141,7 +442,7 @@ int send2current(query_t *q, void *msg, const int len) {
 
   int c=0; // socket index
 
-  while(i != inf_list && c<3)
+  while(i != inf_list && c<fanout_width)
   {
 
     /* If we have matched interfaces for the current query host specified with -H then only forward
@@ -172,24 +473,10 @@ int send2current(query_t *q, void *msg, const int len) {
 			  continue;
 		  }
 
-	  log_debug(3, "Binding to interface %s", i->inf);
-	  bind_sock2inf(q->sock_arr[c],i->inf);
-
-	  /* Try sending if current server is not null. Break as soon as current message is successfully sent. */
-	  while ((i->current != NULL) && (udp_send(q->sock_arr[c], i->current, msg, len) != len)) {
-	  if (reactivate_interval)
-		  deactivate_current(i);
-	  }
-
-    /* Store pointer to server to which we sent request */
-    if(i->current != NULL)
-    {
-    	q->srv_list[c] = i->current;
-    	//printf("Server to which we sent %s\n", inet_ntoa(q->srv_list[c]->addr.sin_addr));
-    }
-
-    /* Keep track of how many servers this query has been sent to. This will be used to decide when to delete the query. */
-    q->serv_sent_cnt++;
+    /* the paths are picked when the query is sent the first time. A
+       client sending it again gets the same ones */
+    if (q->npaths == 0)
+    	q->inf_list[c] = i;
     
     i = i->next;
 
@@ -198,6 +485,28 @@ int send2current(query_t *q, void *msg, const int len) {
 
     c++;
   }
+
+  if (q->npaths == 0) {
+    q->npaths = q->is_dummy ? 1 : c;
+    if (fanout == FANOUT_HEDGE) rank_paths(q);
+  }
+
+  /* with --fanout=hedge only the best path is used now, and the others
+     when it takes too long. Those that have been used already are used
+     again */
+  for (c = 0; c < q->npaths; c++)
+    if (fanout == FANOUT_ALL || c == 0 || q->tries[c] > 0)
+      send_leg(q, c, msg, len);
+
+  /* keep it for the retransmissions and the hedges */
+  if ((forward_retries > 0 || hedge_next(q) >= 0) && !q->is_dummy
+      && len <= UDP_MAXSIZE) {
+    if (q->qpkt == NULL) q->qpkt = pkt_get();
+    memcpy(q->qpkt->data, msg, len);
+    q->qpkt->len = len;
+    arm_retransmit(q);
+    arm_hedge(q);
+  }
   
   if (i->current != NULL) {
     return len;
@@ -206,59 +515,89 @@ int send2current(query_t *q, void *msg, const int len) {
 }
 
 /*
- * This function handles udp DNS requests by either replying to them (if we
- * know the correct reply via master, caching, etc.), or forwarding them to
+ * This function handles a udp DNS request by either replying to it (if we
+ * know the correct reply via master, caching, etc.), or forwarding it to
  * an appropriate DNS server.
+ *
+ * msg must have room for UDP_MAXSIZE+4 bytes since the reply is built
+ * in place.
  */
-query_t *udp_handle_request()
+static void handle_request(int sock, char *msg, int len,
+			   struct sockaddr_in *from_addr, int admitted)
 {
-    unsigned           addr_len;
-    int                len;
+    /* with --lookup-threads the lookups are done by the next free
+       thread, and handle_verdict() is called when it is through */
+    if (!admitted && lookup_threads && lookup_submit(sock, msg, len, from_addr))
+	return;
+
+    handle_verdict(sock, msg, udp_classify(from_addr, msg, &len), len,
+		   from_addr, admitted);
+}
+
+/*
+ * Check the request and look for the answer in the master database
+ * and the cache. Returns -1 if it is bogus, 0 if msg now holds the
+ * reply and 1 if it has to be forwarded. Safe to call from the
+ * lookup threads.
+ */
+int udp_classify(const struct sockaddr_in *from_addr, char *msg, int *len)
+{
+    /* do some basic checking */
+    if (check_query(msg, *len) < 0) return -1;
+
+    return classify_query(from_addr, msg, len);
+}
+
+/*
+ * The part of handle_request() that only the relay loop may do: send
+ * the reply that was found, or forward the request.
+ */
+static void handle_verdict(int sock, char *msg, int fwd, int len,
+			   struct sockaddr_in *from_addr, int admitted)
+{
+    unsigned           addr_len = sizeof(struct sockaddr_in);
     const int          maxsize = UDP_MAXSIZE;
-    static char        msg[UDP_MAXSIZE+4];
-    struct sockaddr_in from_addr;
-    int                fwd;
     infnode_t          *inf_ptr;
     query_t *q, *prev;
 
-    /* Read in the message */
-    addr_len = sizeof(struct sockaddr_in);
-    len = recvfrom(isock, msg, maxsize, 0,
-		   (struct sockaddr *)&from_addr, &addr_len);
-    if (len < 0) {
-	log_debug(1, "recvfrom error %s", strerror(errno));
-	return NULL;
-    }
+    if (fwd < 0)
+      return; /* if its bogus, just ignore it */
 
-    /* do some basic checking */
-    if (check_query(msg, len) < 0) return NULL;
-
-    /* Determine how query should be handled */
-    if ((fwd = handle_query(&from_addr, msg, &len, &inf_ptr)) < 0)
-      return NULL; /* if its bogus, just ignore it */
+    /* pick the server. If there is none it becomes a reply as well */
+    if (fwd > 0)
+      fwd = route_query(msg, &len, &inf_ptr);
 
     /* If we already know the answer, send it and we're done */
     if (fwd == 0) {
-	    if (sendto(isock, msg, len, 0, (const struct sockaddr *)&from_addr,
-		   addr_len) != len) {
-	        log_debug(1, "sendto error %s", strerror(errno));
-	    }
-	    
-        return NULL;
+	    sendq_add(sock, from_addr, msg, len);
+        return;
+    }
+
+    /* somebody asked the same a moment ago, wait for that reply */
+    if (query_join(inf_ptr->current, sock, from_addr, msg, len) != NULL)
+	return;
+
+    /* no room for it now, or others are waiting for room already. It
+       waits its turn, unless it just had it */
+    if (!admitted && (admit_pending() || !query_room())) {
+	admit_add(sock, msg, len, from_addr);
+	return;
     }
 
     /* rewrite msg, get id and add to list*/
-    if ((prev=query_add(inf_ptr, inf_ptr->current, &from_addr, msg, len)) == NULL){
+    if ((prev=query_add(inf_ptr, inf_ptr->current, from_addr, msg, len)) == NULL){
        /* of some reason we could not get any new queries. we have to drop this packet */
-        return NULL;
+        return;
     }
     q = prev->next;
+    /* the reply goes out from the address the client sent to */
+    q->client_sock = sock;
     
     if (send2current(q, msg, len) > 0) {
         //log_debug(1, "Successfully sent query");
 
       /* add to query list etc etc */
-      return q;
+      return;
     } else {
 
       /* we couldn't send the query */
@@ -280,16 +619,117 @@ query_t *udp_handle_request()
       
       if ((packetlen = master_dontknow(msg, len, packet)) > 0) {
 	query_delete_next(prev);
-	return NULL;
-	if (sendto(isock, msg, len, 0, (const struct sockaddr *)&from_addr,
+	return;
+	if (sendto(sock, msg, len, 0, (const struct sockaddr *)from_addr,
 		   addr_len) != len) {
 	  log_debug(1, "sendto error %s", strerror(errno));
-	  return NULL;
+	  return;
 	}
       }
 #endif
     }
-    return q;
+}
+
+void udp_handle_admitted(int sock, char *msg, int len,
+			 struct sockaddr_in *from_addr)
+{
+    handle_request(sock, msg, len, from_addr, 1);
+}
+
+void udp_handle_classified(int sock, char *msg, int verdict, int len,
+			   struct sockaddr_in *from_addr)
+{
+    handle_verdict(sock, msg, verdict, len, from_addr, 0);
+}
+
+/* after a failed receive, is there more to read? An error the socket
+   reports, like one from an ICMP message, is returned only once and
+   the packets behind it are still there. No new edge comes for them */
+static int recv_again(int err)
+{
+    return err != EAGAIN && err != EWOULDBLOCK && err != EBADF
+	&& err != ENOTSOCK && err != EFAULT && err != EINVAL;
+}
+
+/* count a batch of n requests in the batch size histogram */
+static void count_batch(int n)
+{
+    int b = 0;
+    while ((n >>= 1) && b < RECV_HIST_SIZE - 1) b++;
+    recv_batch_hist[b]++;
+}
+
+/*
+ * This function is called when the socket of listener l is readable. It
+ * reads up to recv_batch requests with a single recvmmsg() and handles
+ * all of them before going back to the event loop.
+ *
+ * Returns 0 when there is nothing more to read from it, 1 otherwise.
+ */
+int udp_handle_request(listener_t *l)
+{
+    static char        msg[RECV_BATCH_MAX][UDP_MAXSIZE+4];
+    static char        ctrl[RECV_BATCH_MAX][RECV_CTRLLEN];
+    struct sockaddr_in from_addr[RECV_BATCH_MAX];
+    int                len[RECV_BATCH_MAX];
+    int                i, n;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr     mmsg[RECV_BATCH_MAX];
+    struct iovec       iov[RECV_BATCH_MAX];
+
+    memset(mmsg, 0, sizeof(struct mmsghdr) * recv_batch);
+    for (i = 0; i < recv_batch; i++) {
+	iov[i].iov_base = msg[i];
+	iov[i].iov_len = UDP_MAXSIZE;
+	mmsg[i].msg_hdr.msg_iov = &iov[i];
+	mmsg[i].msg_hdr.msg_iovlen = 1;
+	mmsg[i].msg_hdr.msg_name = &from_addr[i];
+	mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	mmsg[i].msg_hdr.msg_control = ctrl[i];
+	mmsg[i].msg_hdr.msg_controllen = RECV_CTRLLEN;
+    }
+
+    /* Read in the messages */
+    n = event_recvmmsg(l->fd, mmsg, recv_batch);
+    for (i = 0; i < n; i++)
+	len[i] = mmsg[i].msg_len;
+    /* the last one has the latest drop count */
+    if (n > 0)
+	listen_drops += count_drops(&mmsg[n-1].msg_hdr, &l->drops);
+#else
+    /* Read in the messages, one syscall each */
+    for (n = 0; n < recv_batch; n++) {
+	struct msghdr mh;
+	struct iovec  iov;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg[n];
+	iov.iov_len = UDP_MAXSIZE;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_name = &from_addr[n];
+	mh.msg_namelen = sizeof(struct sockaddr_in);
+	mh.msg_control = ctrl[n];
+	mh.msg_controllen = RECV_CTRLLEN;
+	if ((len[n] = event_recvmsg(l->fd, &mh)) < 0)
+	    break;
+	listen_drops += count_drops(&mh, &l->drops);
+    }
+    if (n == 0) n = -1;
+#endif
+    if (n < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    log_debug(1, "recvfrom error %s", strerror(errno));
+	return recv_again(errno);
+    }
+    count_batch(n);
+
+    for (i = 0; i < n; i++)
+	handle_request(l->fd, msg[i], len[i], &from_addr[i], 0);
+
+    /* A short batch means the socket was drained. Anything that
+       arrives later gives us a new edge. */
+    return (n == recv_batch);
 }
 
 int get_interface_name(struct msghdr *mh, char *inf_name)
@@ -374,7 +814,8 @@ srvnode_t * search_server(struct sockaddr_in *resp_ip, char * inf_name)
  * Returns:  A positove number indicating of the bytes received, -1 on a
  *           recvfrom error and 0 if the received message is too large.
  */
-static int reply_recv(query_t *q, int socket_indx, void *msg, int len)
+static int reply_recv(int sock, void *msg, int len, struct sockaddr_in *fromp,
+		      unsigned int *drops_seen)
 {
     int	rc;
     struct sockaddr_in from;
@@ -401,22 +842,24 @@ static int reply_recv(query_t *q, int socket_indx, void *msg, int len)
     mh.msg_iov = iov;
     mh.msg_iovlen = 1;
 
-    rc = recvmsg(q->sock_arr[socket_indx], &mh, 0);
+    rc = event_recvmsg(sock, &mh);
 
     /* recvfrom is replaced with recvmsg to be able to read interface of arriving packet too. */  
     //rc = recvfrom(q->sock_arr[socket_indx], msg, len, 0,
 	//	  (struct sockaddr *) &from, &fromlen);
 
     if (rc == -1) {
-	log_msg(LOG_ERR, "recvfrom error: %s",
-		inet_ntoa(q->srv->addr.sin_addr));
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    log_msg(LOG_ERR, "recvfrom error: %s", strerror(errno));
 	return (-1);
     }
     else if (rc > len) {
 	log_msg(LOG_NOTICE, "packet too large: %s",
-		inet_ntoa(q->srv->addr.sin_addr));
+		inet_ntoa(from.sin_addr));
 	return (0);
     }
+    memcpy(fromp, &from, sizeof(from));
+    if (drops_seen) upstream_drops += count_drops(&mh, drops_seen);
     
     //from = peeraddr;
 
@@ -452,6 +895,19 @@ static int reply_recv(query_t *q, int socket_indx, void *msg, int len)
     return (rc);
 }
 
+/* the server leg c of q was sent to that from is the address of, NULL
+   if it wasn't sent to that one */
+static srvnode_t *leg_server(query_t *q, int c, const struct sockaddr_in *from)
+{
+    srvnode_t *s = q->srv;
+
+    if (q->is_dummy)
+	return s->addr.sin_addr.s_addr == from->sin_addr.s_addr
+	    && s->addr.sin_port == from->sin_port ? s : NULL;
+    if (q->inf_list[c] == NULL || q->tries[c] == 0) return NULL;
+    return server_in_mask(q->inf_list[c], q->tried[c], from);
+}
+
 /*
  * handle_udpreply()
  *
@@ -460,39 +916,182 @@ static int reply_recv(query_t *q, int socket_indx, void *msg, int len)
  * an appropriate DNS server.
  *
  * Note that the mached query is prev->next and not prev.
+ *
+ * Returns 1 if the query is still alive and the socket should be read
+ * again, 0 if the socket is drained or the query was removed.
  */
-void udp_handle_reply(query_t *prev, int sock_indx)
+int udp_handle_reply(query_t *prev, int sock_indx)
 {
   //    const int          maxsize = 512; /* According to RFC 1035 */
-    static char        msg[UDP_MAXSIZE+4];
-    int                len;
-    unsigned           addr_len;
+    pkt_t             *p = pkt_get();
+    int                len, rc;
+    struct sockaddr_in from;
     query_t *q = prev->next;
     
     log_debug(3, "handling socket %i", q->sock_arr[sock_indx]);
-    if ((len = reply_recv(q, sock_indx, msg, UDP_MAXSIZE)) < 0)
+    if ((len = reply_recv(q->sock_arr[sock_indx], p->data, UDP_MAXSIZE, &from,
+			  NULL)) < 0)
     {
+	    pkt_put(p);
+	    if (!recv_again(errno))
+		    return 0; /* nothing more to read */
+
+	    /* what came in behind the error is still read. The leg is
+	       left to its retransmissions and timeout */
 	    log_debug(1, "dnsrecv failed: %i", len);
-	    
-        if(q->serv_sent_cnt == 1)	    
-	        query_delete_next(prev);
-	    else    
-    	    q->serv_sent_cnt--;
-	    return; /* recv error */
+	    return 1;
+    }
+    p->len = len;
+
+    /* the socket is the query's own, but the reply must still carry
+       its qid */
+    if (len < 2 || query_find(ntohs(*((unsigned short *)p->data))) != q) {
+	reply_unmatched++;
+	log_debug(2, "Dropping reply with wrong id from %s",
+		  inet_ntoa(from.sin_addr));
+	pkt_put(p);
+	return 1;
+    }
+    rc = handle_reply(prev, sock_indx, leg_server(q, sock_indx, &from), p);
+    pkt_put(p);
+    return rc;
+}
+
+/*
+ * udp_handle_upreply()
+ *
+ * Read a reply from a shared upstream socket. The query is looked up by
+ * the qid in the reply and it must have a leg that was sent through
+ * this socket to the server the reply came from. Anything else is
+ * dropped.
+ *
+ * Returns 1 if the socket should be read again, 0 when it is drained.
+ */
+int udp_handle_upreply(upsock_t *u)
+{
+    pkt_t             *p = pkt_get();
+    char              *msg = p->data;
+    int                len, c, legs;
+    struct sockaddr_in from;
+    query_t *q;
+    srvnode_t *s = NULL;
+    probe_t *pr;
+
+    if ((len = reply_recv(u->fd, msg, UDP_MAXSIZE, &from, &u->drops)) < 0) {
+	pkt_put(p);
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return 0; /* nothing more to read */
+	log_debug(1, "dnsrecv failed on %s", u->inf->inf);
+	return recv_again(errno);
+    }
+    p->len = len;
+    if (len < 2) {
+	pkt_put(p);
+	return 1;
+    }
+
+    if ((q = query_find(ntohs(*((unsigned short *)msg)))) != NULL) {
+	legs = q->is_dummy ? 1 : fanout_width;
+	for (c = 0; c < legs; c++)
+	    if (q->sock_arr[c] == u->fd
+		&& (s = leg_server(q, c, &from)) != NULL)
+		break;
+	if (c < legs) {
+	    /* a leg gets one reply, later copies are dropped */
+	    q->sock_arr[c] = -1;
+	    handle_reply(q->prev, c, s, p);
+	    pkt_put(p);
+	    return 1;
+	}
+    } else if ((pr = probe_find(ntohs(*((unsigned short *)msg)), u->fd,
+				&from, &s)) != NULL) {
+	probe_reply(pr, s, p);
+	pkt_put(p);
+	return 1;
+    }
+
+    reply_unmatched++;
+    log_debug(2, "Dropping unmatched reply id=%i from %s",
+	      ntohs(*((unsigned short *)msg)), inet_ntoa(from.sin_addr));
+    pkt_put(p);
+    return 1;
+}
+
+/* fold a new round trip time into the server's smoothed rtt, the way
+   tcp does it (RFC 6298) */
+static void update_rtt(srvnode_t *s, msec_t sent)
+{
+    int rtt = (int)(clock_ms - sent), delta;
+
+    if (rtt < 1) rtt = 1;
+    if (s->srtt == 0) {
+	s->srtt = rtt;
+	s->rttvar = rtt / 2;
+	return;
+    }
+    delta = rtt > s->srtt ? rtt - s->srtt : s->srtt - rtt;
+    s->rttvar += (delta - s->rttvar) / 4;
+    s->srtt += (rtt - s->srtt) / 8;
+    if (s->srtt < 1) s->srtt = 1;
+}
+
+/* q is answered and deleted with the sockets of the legs still out, so
+   their replies are lost. A server that would likely still have
+   answered, one with a known rtt whose leg isn't overdue, must not time
+   out for that. Returns 1, q can be deleted, like probe_take() */
+static int drop_legs(query_t *q)
+{
+    srvnode_t *s;
+    int c;
+
+    for (c = 0; c < q->npaths; c++) {
+	if (!(q->legs_out & (1 << c)) || (s = q->srv_list[c]) == NULL)
+	    continue;
+	if (s->srtt && clock_ms - q->sent[c] < leg_rto(q, c))
+	    s->send_time = 0;
+	legs_dropped++;
+    }
+    return 1;
+}
+
+/* handle a reply for prev->next that came in on the given leg from
+   srv, NULL if it isn't one the leg was sent to. Same return value as
+   udp_handle_reply() */
+static int handle_reply(query_t *prev, int leg, srvnode_t *srv, pkt_t *p)
+{
+    char *msg = p->data;
+    int len = p->len;
+    query_t *q = prev->next;
+
+    /* a leg is answered once. If it was sent more than once, the
+       replies to the other tries are dropped */
+    if (!q->is_dummy) {
+      if (!(q->legs_out & (1 << leg))) return 1;
+      q->legs_out &= ~(1 << leg);
     }
 
     /* do basic checking */
     if (check_reply(q->srv, msg, len) < 0) {
       log_debug(1, "check_reply failed");
 
-      if(q->serv_sent_cnt == 1)	    
+      /* don't wait for the next leg when this one failed */
+      if (hedge_next(q) >= 0) hedge(q);
+
+      if(q->serv_sent_cnt == 1) {
           query_delete_next(prev);
-      else    
-          q->serv_sent_cnt--;
-      
-      return;
+          return 0;
+      }
+      q->serv_sent_cnt--;
+      return 1;
     }
 
+    /* a reply to a retransmission could be to either try, it says
+       nothing about the rtt (Karn's algorithm). Neither does one from
+       a server the leg was moved away from after a failed send */
+    if (srv != NULL
+	&& (q->is_dummy || (q->tries[leg] == 1 && srv == q->srv_list[leg])))
+      update_rtt(srv, q->sent[leg]);
+
     if (opt_debug) {
 	  char buf[256];
 	  snprintf_cname(msg, len, 12, buf, sizeof(buf));
@@ -504,53 +1103,37 @@ void udp_handle_reply(query_t *prev, int sock_indx)
     }
     
     dump_dnspacket("reply", msg, len);
-    addr_len = sizeof(struct sockaddr_in);
 
     /* was this a dummy reactivate query? If no, have we already sent a response */
     if (q->is_dummy == 0 && q->resp_sent == 0) {
     
       int rcode = check_replycode(msg,len);    
       log_debug(3, "Received reply code is %d (non zero value indicates unsuccessfull response)", rcode);
+
+      if (rcode != 0 && hedge_next(q) >= 0) hedge(q);
       
       if(rcode == 0 || q->serv_sent_cnt == 1) // If it is a successful response or there are no others queries to be waited for
       {
           /* no, lets cache the reply and send it to client */
-          cache_dnspacket(msg, len, q->srv);
+          cache_pkt(p, q->srv);
           
-          /* set the client qid */
-          *((unsigned short *)msg) = q->client_qid;
+          /* the buffer is shared with the cache, the client qid is
+             patched in by the send queue */
           log_debug(3, "Forwarding the reply to the host %s",
 		    inet_ntoa(q->client.sin_addr));
-          if (sendto(isock, msg, len, 0,
-		    (const struct sockaddr *)&q->client,
-		    addr_len) != len) {
-	        log_debug(1, "sendto error %s", strerror(errno));
-          }
-          
-          q->resp_sent = 1; /* set query flag that we have forwarded a successful response to client */
+          if (q->hedges & (1 << leg)) hedge_wins++;
+          timer_del(&q->hedge_timer);
+          query_answer(q, p); /* and sets resp_sent */
       }
        
       else {
          
-         if (q->fail_msg_len == 0)//if(q->cached_fail_msg == NULL)
+         if (q->fail_pkt == NULL)
          {
              log_debug(2, "It is not a successful response and we wait for responses from other servers while caching current one");
 
-             q->cached_fail_msg = (char *)allocate(len);
-         
-            if(q->cached_fail_msg != NULL)
-            {
-                q->fail_msg_len = len;
-                memcpy(q->cached_fail_msg, msg, len);
-                log_debug (5, "MSG length is %d\n", q->fail_msg_len);
-            
-                /*int i;
-                for (i=0; i<len; i++)
-                    printf("%x",q->cached_fail_msg[i]);
-                printf("\n");*/
-            }
-            else
-             	log_debug(1, "Failed allocating memory for failure response");
+             q->fail_pkt = pkt_ref(p);
+             log_debug (5, "MSG length is %d\n", len);
          }
          
          else
@@ -580,6 +1163,15 @@ void udp_handle_reply(query_t *prev, int sock_indx)
 #endif     
     
     
+    /* the client has its answer. The legs still out are only waited
+       for to hear from their servers. On shared sockets probes do that
+       without the query, else the sockets are closed with it */
+    if (q->resp_sent && q->serv_sent_cnt > 1
+	&& (shared_sockets ? probe_take(q) : drop_legs(q))) {
+        query_delete_next(prev);
+        return 0;
+    }
+
     /* Remove query from list and destroy it 
      * IF no other server requests are pending for this one.
      * Otherwise, just decrement the counter.
@@ -587,18 +1179,12 @@ void udp_handle_reply(query_t *prev, int sock_indx)
     if(q->serv_sent_cnt == 1 /*|| q->resp_sent == 1 */)
     {
         log_debug(5, "deleting query after handling reply successfully");
-        
-	int a=0;
-	for(;a<3;a++)
-	{	if(q->srv_list[a] != NULL)
-		{
-			srvnode_t * srv = q->srv_list[a];
-    			//printf("Server BEFORE QUERY DELETE %s\n", inet_ntoa(srv->addr.sin_addr));
-			srv->inactive = 0;
-			srv->send_time = 0;
-		} 
-	}
+
+        /* only the server the reply came from is known to be alive,
+           reply_recv() has reset its timeout. The others must still
+           time out if they don't answer */
         query_delete_next(prev);
+        return 0;
     }
         
     else
@@ -613,11 +1199,24 @@ void udp_handle_reply(query_t *prev, int sock_indx)
         //if(q->resp_sent == 1) /* Only reset dummy flag if we have already sent a response */
         //    q->is_dummy = 1;        
     }
+    return 1;
 }
 
 
+/* the reply p from srv for the leg left to pr. reply_recv() has
+   already reset the timeout of srv */
+static void probe_reply(probe_t *pr, srvnode_t *srv, pkt_t *p)
+{
+    if (check_reply(srv, p->data, p->len) < 0)
+	log_debug(1, "check_reply failed");
+    else if (pr->tries == 1)
+	update_rtt(srv, pr->sent);
+    probes_answered++;
+    probe_done(pr);
+}
+
 /* send a dummy packet to a deactivated server to check if its back*/
-int udp_send_dummy(srvnode_t *s) {
+int udp_send_dummy(infnode_t *i, srvnode_t *s) {
   static unsigned char dnsbuf[] = {
   /* HEADER */
     /* we send a lookup for localhost */
@@ -648,13 +1247,16 @@ int udp_send_dummy(srvnode_t *s) {
     int rc;
     q = q->next; /* query add returned the query 1 before in list */
     /* don't let those queries live too long */
-    q->ttl = reactivate_interval;
+    query_set_ttl(q, MSEC(reactivate_interval));
     memset(&srcaddr, 0, sizeof(srcaddr));
     log_debug(2, "Sending dummy id=%i to %s", ((unsigned short *)dnsbuf)[0], 
 	      inet_ntoa(s->addr.sin_addr));
     /*  return dnssend(s, &dnsbuf, sizeof(dnsbuf)); */
 
     // For a dummy query only 0th index socket is valid
+    if (shared_sockets)
+      q->sock_arr[0] = upsock_get(i);
+    q->sent[0] = clock_ms;
     rc=udp_send(q->sock_arr[0], s, dnsbuf, sizeof(dnsbuf));
     ((unsigned short *)dnsbuf)[0]++;
     return rc;
@@ -22,16 +22,66 @@
 #define _DNRD_UDP_H_
 #include "srvnode.h"
 #include "query.h"
+#include "upsock.h"
 
-/* Function to call when a message is available on isock */
-/* returns the new query */
-query_t *udp_handle_request();
+/* histogram of recvmmsg() batch sizes: 1, 2-3, 4-7, ... 64 */
+#define RECV_HIST_SIZE 7
+/* room for the control data of a request */
+#define RECV_CTRLLEN 64
+extern unsigned long recv_batch_hist[RECV_HIST_SIZE];
+
+/* socket buffer sizes for the listeners and the upstream sockets, 0
+   for the system default */
+extern int listen_rcvbuf, listen_sndbuf;
+extern int upstream_rcvbuf, upstream_sndbuf;
+/* packets the kernel dropped because the socket buffer was full */
+extern unsigned long listen_drops, upstream_drops;
+/* replies that didn't match the qid of a live query */
+extern unsigned long reply_unmatched;
+/* legs sent because the ones before them were slow, and the queries
+   that were answered first by one of them */
+extern unsigned long hedges_sent, hedge_wins;
+/* legs still out whose sockets were closed when their query was
+   answered */
+extern unsigned long legs_dropped;
+
+/* set the buffer sizes of a new socket and have the kernel report
+   its drops */
+void udp_sock_setup(int sock, int rcvbuf, int sndbuf);
+
+/* Function to call when a message is available on a listener */
+/* returns 0 when its socket has been drained */
+struct _listener;
+int udp_handle_request(struct _listener *l);
+
+/* handle a request that waited in the admission queue. msg must have
+   room for UDP_MAXSIZE+4 bytes */
+void udp_handle_admitted(int sock, char *msg, int len,
+			 struct sockaddr_in *from_addr);
+
+/* check a request and answer it from the master database or the
+   cache. Returns -1 if it is bogus, 0 if msg now holds the reply and
+   1 if it has to be forwarded. The lookup threads call this */
+int udp_classify(const struct sockaddr_in *from_addr, char *msg, int *len);
+
+/* finish a request that udp_classify() has been called for: send the
+   reply or forward it. msg must have room for UDP_MAXSIZE+4 bytes */
+void udp_handle_classified(int sock, char *msg, int verdict, int len,
+			   struct sockaddr_in *from_addr);
 
 /* Call this to handle upd DNS replies */
-void udp_handle_reply(query_t *q, int socket_indx);
+/* returns 0 when the socket is drained or the query is gone */
+int udp_handle_reply(query_t *q, int socket_indx);
+
+/* Call this when a shared upstream socket is readable */
+/* returns 0 when the socket is drained */
+int udp_handle_upreply(upsock_t *u);
+
+/* send a reactivation packet to s through interface i */
+int udp_send_dummy(infnode_t *i, srvnode_t *s);
 
-/* send a reactivation packet */
-int udp_send_dummy(srvnode_t *s);
+/* bind sock to the device inf_name */
+int bind_sock2inf(int sock, char *inf_name);
 
 
 #endif /* _DNRD_UDP_H_ */
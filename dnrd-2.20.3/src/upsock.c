@@ -0,0 +1,289 @@
+/*
+ * upsock.c - upstream sockets shared by all queries of an interface
+ *
+ * With --shared-sockets=N every interface gets N long lived upstream
+ * sockets that are opened, bound and bound to the device once at
+ * startup. Queries take turns sending through them and replies are
+ * matched back to their query by qid, socket and server address
+ * instead of by the socket they arrive on.
+ *
+ * To keep the source ports moving, a socket is replaced after
+ * --socket-uses queries or --socket-age seconds with a spare from a
+ * small pool that the relay loop keeps filled between rounds, so no
+ * socket is set up while a query waits for it. The replaced socket
+ * stays open until the queries sent through it have timed out.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "lib.h"
+#include "query.h"
+#include "udp.h"
+#include "worker.h"
+#include "upsock.h"
+#include "sendq.h"
+#include "relay.h"
+#include "clock.h"
+#include "timer.h"
+
+int shared_sockets = 0;
+int upsock_pool = UPSOCK_POOL;
+int upsock_uses = UPSOCK_USES;
+int upsock_age = UPSOCK_AGE;
+
+unsigned long upsock_opened = 0;
+unsigned long upsock_retired = 0;
+unsigned long upsock_starved = 0;
+
+/* replaced sockets that replies may still arrive on, oldest first */
+static upsock_t *retired = NULL, *retired_tail = NULL;
+/* sockets are added to the event loop when they are opened from now on */
+static int registered = 0;
+/* set when a socket could not be bound to its device after we gave
+   up root. The sockets in use are kept from then on */
+static int refill_failed = 0;
+/* closes the retired sockets when their time is up */
+static tmr_t retire_timer;
+
+static upsock_t *open_one(infnode_t *i, int worker) {
+  upsock_t *u;
+  int sock, opt = 1;
+
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    log_msg(LOG_ERR, "%s: couldn't open upstream socket: %s", i->inf,
+	    strerror(errno));
+    return NULL;
+  }
+
+  /* so the interface can be read with recvmsg() */
+  setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &opt, sizeof(opt));
+  bind_random_port(sock);
+  udp_sock_setup(sock, upstream_rcvbuf, upstream_sndbuf);
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  busy_poll_sock(sock);
+  if (bind_sock2inf(sock, i->inf) < 0) {
+    if (registered) {
+      /* an unbound socket would send through the wrong interface */
+      close(sock);
+      return NULL;
+    }
+    log_msg(LOG_WARNING, "%s: couldn't bind upstream socket to the device",
+	    i->inf);
+  }
+
+  u = (upsock_t *)allocate(sizeof(upsock_t));
+  u->fd = sock;
+  u->inf = i;
+  u->worker = worker;
+  u->time = clock_now;
+  if (registered && event_add(&u->ev, sock, EV_UPSTREAM, u, 0) < 0) {
+    close(sock);
+    free(u);
+    return NULL;
+  }
+  upsock_opened++;
+  return u;
+}
+
+static void close_one(upsock_t *u) {
+  if (registered) event_del(&u->ev);
+  sendq_forget(u->fd);
+  close(u->fd);
+  free(u);
+}
+
+void upsock_open(void) {
+  infnode_t *i;
+  upsock_t *u;
+  int n;
+
+  if (!shared_sockets) return;
+
+  for (i = inf_list->next; i != inf_list; i = i->next) {
+    /* one slice per worker, the others are closed after the fork */
+    i->nupsock = workers * shared_sockets;
+    i->upsock = (upsock_t **)allocate(sizeof(upsock_t *) * i->nupsock);
+    for (n = 0; n < i->nupsock; n++)
+      if ((i->upsock[n] = open_one(i, n / shared_sockets)) == NULL)
+	log_err_exit(-1, "%s: couldn't open the upstream sockets", i->inf);
+    for (n = 0; n < workers * upsock_pool; n++) {
+      if ((u = open_one(i, n / upsock_pool)) == NULL) break;
+      u->next = i->upspare;
+      i->upspare = u;
+    }
+    i->upsock_next = 0;
+    log_debug(1, "%s: opened %i upstream sockets and %i spares", i->inf,
+	      i->nupsock, n);
+  }
+}
+
+void upsock_keep(int worker) {
+  infnode_t *i;
+  upsock_t *u, **up;
+  int n;
+
+  if (!shared_sockets) return;
+
+  for (i = inf_list->next; i != inf_list; i = i->next) {
+    for (n = 0; n < i->nupsock; n++)
+      if (i->upsock[n]->worker != worker) close_one(i->upsock[n]);
+    memmove(i->upsock, &i->upsock[worker * shared_sockets],
+	    sizeof(upsock_t *) * shared_sockets);
+    i->nupsock = shared_sockets;
+
+    i->nupspare = 0;
+    for (up = &i->upspare; (u = *up) != NULL; ) {
+      if (u->worker != worker) {
+	*up = u->next;
+	close_one(u);
+      } else {
+	i->nupspare++;
+	up = &u->next;
+      }
+    }
+  }
+}
+
+void upsock_register(void) {
+  infnode_t *i;
+  upsock_t *u;
+  int n;
+
+  if (!shared_sockets) return;
+
+  for (i = inf_list->next; i != inf_list; i = i->next) {
+    for (n = 0; n < i->nupsock; n++)
+      if (event_add(&i->upsock[n]->ev, i->upsock[n]->fd, EV_UPSTREAM,
+		    i->upsock[n], n) < 0)
+	log_err_exit(-1, "%s: Couldn't add upstream socket to the event loop",
+		     i->inf);
+    /* spares are registered as well, so swapping one in is free */
+    for (u = i->upspare; u; u = u->next)
+      if (event_add(&u->ev, u->fd, EV_UPSTREAM, u, 0) < 0)
+	log_err_exit(-1, "%s: Couldn't add upstream socket to the event loop",
+		     i->inf);
+  }
+  registered = 1;
+}
+
+/* seconds a retired socket is kept open. No query lives longer than
+   this without being sent again, and then it is sent through a socket
+   in use */
+static int linger(void) {
+  return ((forward_timeout + 999) / 1000 > reactivate_interval ?
+	  (forward_timeout + 999) / 1000 : reactivate_interval)
+    + select_timeout;
+}
+
+static void close_retired(void *arg) {
+  upsock_t *u;
+  time_t now = clock_now;
+
+  while (retired && now - retired->time > linger()) {
+    u = retired;
+    if ((retired = u->next) == NULL) retired_tail = NULL;
+    close_one(u);
+  }
+  if (retired)
+    timer_set(&retire_timer,
+	      clock_ms + MSEC(retired->time + linger() + 1 - now),
+	      close_retired, NULL);
+}
+
+/* is it time to replace u? */
+static int worn_out(upsock_t *u, time_t now) {
+  return (upsock_uses && u->uses >= upsock_uses)
+    || (upsock_age && now - u->time >= upsock_age);
+}
+
+int upsock_get(infnode_t *i) {
+  int n = i->upsock_next;
+  upsock_t *u = i->upsock[n];
+
+  if (++i->upsock_next == i->nupsock) i->upsock_next = 0;
+
+  if (worn_out(u, clock_now)) {
+    if (i->upspare == NULL) {
+      upsock_starved++;
+    } else {
+      /* swap in a spare. The old one is kept for the replies that
+	 are still on their way */
+      i->upsock[n] = i->upspare;
+      i->upspare = i->upspare->next;
+      i->nupspare--;
+      i->upsock[n]->time = clock_now;
+      u->time = clock_now;
+      u->next = NULL;
+      if (retired_tail) retired_tail->next = u;
+      else retired = u;
+      retired_tail = u;
+      upsock_retired++;
+      if (!timer_pending(&retire_timer))
+	timer_set(&retire_timer, clock_ms + MSEC(linger() + 1),
+		  close_retired, NULL);
+      u = i->upsock[n];
+    }
+  }
+  u->uses++;
+  return u->fd;
+}
+
+int upsock_live(infnode_t *i, int fd) {
+  int n;
+
+  for (n = 0; n < i->nupsock; n++)
+    if (i->upsock[n]->fd == fd) return 1;
+  return 0;
+}
+
+void upsock_refill(void) {
+  infnode_t *i;
+  upsock_t *u;
+
+  if (!shared_sockets || refill_failed) return;
+  for (i = inf_list->next; i != inf_list; i = i->next)
+    while (i->nupspare < upsock_pool) {
+      if ((u = open_one(i, worker_id)) == NULL) {
+	log_msg(LOG_WARNING, "%s: couldn't open spare upstream sockets, "
+		"keeping the ones in use", i->inf);
+	refill_failed = 1;
+	return;
+      }
+      u->next = i->upspare;
+      i->upspare = u;
+      i->nupspare++;
+    }
+}
+
+int upsock_spares(void) {
+  infnode_t *i;
+  int n = 0;
+
+  for (i = inf_list->next; i != inf_list; i = i->next)
+    n += i->nupspare;
+  return n;
+}
@@ -0,0 +1,92 @@
+/*
+ * upsock.h - upstream sockets shared by all queries of an interface
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_UPSOCK_H_
+#define _DNRD_UPSOCK_H_
+
+#include <time.h>
+#include "infnode.h"
+#include "event.h"
+
+/* upper limit for --shared-sockets */
+#ifndef UPSOCK_MAX
+#define UPSOCK_MAX 64
+#endif
+
+/* defaults for --socket-pool, --socket-uses and --socket-age */
+#ifndef UPSOCK_POOL
+#define UPSOCK_POOL 4
+#endif
+#ifndef UPSOCK_USES
+#define UPSOCK_USES 1000
+#endif
+#ifndef UPSOCK_AGE
+#define UPSOCK_AGE 60
+#endif
+
+typedef struct _upsock {
+  int        fd;
+  event_t    ev;
+  infnode_t *inf;  /* the interface the socket is bound to */
+  int        worker; /* the worker it was opened for */
+  int        uses; /* queries sent through it */
+  time_t     time; /* when it was opened, or retired */
+  unsigned int drops; /* the kernel's drop count, as last seen */
+  struct _upsock *next; /* in the spare or retired list */
+} upsock_t;
+
+/* sockets per interface and worker, 0 to open new sockets for every
+   query (--shared-sockets) */
+extern int shared_sockets;
+
+/* spare sockets kept ready per interface, and when a socket in use is
+   replaced with one of them (0 for never) */
+extern int upsock_pool;
+extern int upsock_uses;
+extern int upsock_age;
+
+/* sockets opened and retired, and times a worn out socket had to be
+   used again because the pool was empty */
+extern unsigned long upsock_opened;
+extern unsigned long upsock_retired;
+extern unsigned long upsock_starved;
+
+/* open the sockets of all interfaces. Needs root for SO_BINDTODEVICE */
+void upsock_open(void);
+
+/* close the sockets that belong to the other workers */
+void upsock_keep(int worker);
+
+/* register the sockets with the event loop */
+void upsock_register(void);
+
+/* next socket to send through on interface i */
+int upsock_get(infnode_t *i);
+
+/* is fd one of the sockets of i that are in use? A retired socket is
+   closed some time after it was replaced */
+int upsock_live(infnode_t *i, int fd);
+
+/* top up the spare sockets. Called from the relay loop when the
+   events of a round have been handled */
+void upsock_refill(void);
+
+/* number of spare sockets over all interfaces */
+int upsock_spares(void);
+
+#endif /* _DNRD_UPSOCK_H_ */
@@ -0,0 +1,583 @@
+/*
+ * uring.c - io_uring backend for the relay loop
+ *
+ * Instead of waiting for readiness and then reading, every registered
+ * udp socket has a multishot recvmsg posted on it. The kernel places
+ * the packets in a ring of receive buffers that is registered once at
+ * startup, and the relay loop gets them with the completions. Replies
+ * to clients are queued as sendmsg requests and go to the kernel with
+ * the next wait, so neither direction needs a system call per packet.
+ *
+ * The protocol code doesn't see any of this. uring_recvmsg() hands
+ * out the received packets the way recvmsg() would, so
+ * udp_handle_request() and udp_handle_reply() work with both backends.
+ *
+ * We talk to the kernel directly and don't need liburing. Multishot
+ * receives need Linux 6.0 or later; on older kernels uring_init() fails
+ * and the relay falls back to epoll.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef ENABLE_IO_URING
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "common.h"
+#include "lib.h"
+#include "check.h"
+#include "sendq.h"
+#include "uring.h"
+
+#ifndef IORING_RECV_MULTISHOT
+#error "io_uring support needs the kernel headers from Linux 6.0 or later"
+#endif
+
+/* What a completion belongs to. user_data holds the kind in the top
+ * byte, then the generation of the fd, then the fd (or the send queue
+ * slot). A completion for a socket that has been unregistered since
+ * carries an old generation and is ignored. */
+#define UR_RECV    1ULL
+#define UR_POLL    2ULL
+#define UR_SEND    3ULL
+#define UR_CANCEL  4ULL
+
+#define UR_DATA(kind, gen, n) (((kind) << 56) | \
+			       ((__u64)((gen) & 0xffffff) << 32) | (__u32)(n))
+#define UR_KIND(d) ((d) >> 56)
+#define UR_GEN(d)  ((unsigned)(((d) >> 32) & 0xffffff))
+#define UR_NUM(d)  ((int)((d) & 0xffffffff))
+
+/* room for the control messages we ask for (IP_PKTINFO) */
+#define UR_CTRLLEN 64
+
+/* a receive buffer: the recvmsg header, the address, the control
+   messages and the packet itself */
+#define UR_BUFSIZE (sizeof(struct io_uring_recvmsg_out) + \
+		    sizeof(struct sockaddr_in) + UR_CTRLLEN + UDP_MAXSIZE + 4)
+
+/* state for a registered socket, indexed by fd */
+typedef struct {
+  event_t  *ev;         /* NULL if the fd is not registered */
+  unsigned  gen;        /* bumped each time the fd is unregistered */
+  int       rearm;      /* the multishot request ended, post a new one */
+  unsigned  round;      /* last round the fd was reported ready */
+  int       head, tail; /* buffer ids of unread packets, -1 if none */
+} ur_fd_t;
+
+static int ring_fd = -1;
+
+/* submission queue */
+static unsigned            sq_entries;
+static unsigned           *sq_head, *sq_tail, *sq_mask;
+static unsigned            sqe_tail;  /* our copy of *sq_tail */
+static unsigned            to_submit; /* filled in, not yet submitted */
+static struct io_uring_sqe *sqes;
+
+/* completion queue */
+static unsigned            *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* the registered receive buffers */
+static struct io_uring_buf_ring *br;
+static unsigned short br_tail;
+static char          *bufs;
+static int            buf_len[URING_NBUFS];  /* bytes the kernel wrote */
+static int            buf_next[URING_NBUFS]; /* next unread packet */
+
+static ur_fd_t *fds = NULL;
+static int     *rearm_list = NULL;
+static int      nfds = 0, nrearm = 0;
+static unsigned round = 0;
+
+/* template for the multishot receives. Only the lengths are used,
+   they tell the kernel how to lay out each buffer */
+static struct msghdr recv_tmpl;
+
+static int sys_enter(unsigned submit, unsigned min, unsigned flags,
+		     void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, ring_fd, submit, min, flags,
+		 arg, argsz);
+}
+
+static int sys_register(unsigned op, void *arg, unsigned n) {
+  return syscall(__NR_io_uring_register, ring_fd, op, arg, n);
+}
+
+/* hand all filled in sqes to the kernel */
+static int submit(void) {
+  int rc = sys_enter(to_submit, 0, 0, NULL, 0);
+  if (rc > 0) to_submit -= (unsigned)rc > to_submit ? to_submit : rc;
+  return rc;
+}
+
+/* the next free sqe, cleared. NULL if the queue is full even after
+   submitting what's in it */
+static struct io_uring_sqe *get_sqe(void) {
+  struct io_uring_sqe *sqe;
+
+  if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    submit();
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+      return NULL;
+  }
+  sqe = &sqes[sqe_tail & *sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe_tail++;
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  to_submit++;
+  return sqe;
+}
+
+/* give a receive buffer back to the kernel */
+static void buf_return(int bid) {
+  struct io_uring_buf *b = &br->bufs[br_tail & (URING_NBUFS - 1)];
+
+  b->addr = (unsigned long)(bufs + bid * UR_BUFSIZE);
+  b->len = UR_BUFSIZE;
+  b->bid = bid;
+  br_tail++;
+  __atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+}
+
+/* check that the kernel has the opcodes we use */
+static int probe(void) {
+  static const int need[] = { IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+			      IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+  struct io_uring_probe *p;
+  size_t size = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+  unsigned i;
+  int rc = 0;
+
+  p = allocate(size);
+  if (sys_register(IORING_REGISTER_PROBE, p, 256) < 0) {
+    free(p);
+    return -1;
+  }
+  for (i = 0; i < sizeof(need) / sizeof(need[0]); i++)
+    if (need[i] > p->last_op || !(p->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+      rc = -1;
+  free(p);
+  return rc;
+}
+
+/* The opcodes don't tell if a receive can be multishot. Post one on
+   a socket of our own and send it a packet: a kernel that can do it
+   keeps the request going after the first completion. The request is
+   cancelled and reaped before the socket is closed */
+static int probe_multishot(void) {
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts = { 1, 0 };
+  unsigned head;
+  int fd, more = 1, rc = -1;
+  char c = 0;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+      || getsockname(fd, (struct sockaddr *)&sa, &salen) < 0
+      || sendto(fd, &c, 1, 0, (struct sockaddr *)&sa, salen) != 1
+      || (sqe = get_sqe()) == NULL) {
+    close(fd);
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)&recv_tmpl;
+  sqe->len = 1;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = UR_DATA(UR_RECV, 0, fd);
+
+  /* reap until the receive has ended, cancelling it once it has
+     shown that it goes on. The ring is given up if that takes long */
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (unsigned long)&ts;
+  while (more) {
+    if (sys_enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		  &arg, sizeof(arg)) < 0 && errno != EINTR)
+      break;
+    to_submit = 0;
+    head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &cqes[head++ & *cq_mask];
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+	buf_return(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      if (UR_KIND(cqe->user_data) != UR_RECV) continue;
+      if (!(cqe->flags & IORING_CQE_F_MORE)) more = 0;
+      else if (rc < 0 && cqe->res >= 0 && (sqe = get_sqe()) != NULL) {
+	rc = 0;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = UR_DATA(UR_RECV, 0, fd);
+	sqe->user_data = UR_DATA(UR_CANCEL, 0, 0);
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  close(fd);
+  return more ? -1 : rc;
+}
+
+int uring_init(void) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t ringsz;
+  char *ring;
+  unsigned *sq_array;
+  unsigned i;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+    | IORING_SETUP_SINGLE_ISSUER;
+  if ((ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+    log_msg(LOG_WARNING, "io_uring_setup: %s", strerror(errno));
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+      || !(p.features & IORING_FEAT_EXT_ARG)
+      || !(p.features & IORING_FEAT_NODROP) || probe() < 0) {
+    log_msg(LOG_WARNING, "io_uring: kernel is too old");
+    goto fail;
+  }
+
+  /* the sq and cq rings share one mapping */
+  ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ringsz)
+    ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring = mmap(NULL, ringsz, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) goto fail_errno;
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) goto fail_errno;
+
+  sq_entries = p.sq_entries;
+  sq_head = (unsigned *)(ring + p.sq_off.head);
+  sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(ring + p.sq_off.array);
+  cq_head = (unsigned *)(ring + p.cq_off.head);
+  cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  sqe_tail = *sq_tail;
+  /* sqes are always used in order */
+  for (i = 0; i < sq_entries; i++) sq_array[i] = i;
+
+  /* register the receive buffers */
+  br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br == MAP_FAILED) goto fail_errno;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)br;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = 0;
+  if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail_errno;
+  bufs = allocate(URING_NBUFS * UR_BUFSIZE);
+  for (i = 0; i < URING_NBUFS; i++) buf_return(i);
+
+  recv_tmpl.msg_namelen = sizeof(struct sockaddr_in);
+  recv_tmpl.msg_controllen = UR_CTRLLEN;
+  if (probe_multishot() < 0) {
+    log_msg(LOG_WARNING, "io_uring: kernel can't do multishot receives");
+    goto fail;
+  }
+
+  log_debug(1, "Using io_uring with %i receive buffers", URING_NBUFS);
+  return 0;
+
+ fail_errno:
+  log_msg(LOG_WARNING, "io_uring: %s", strerror(errno));
+ fail:
+  close(ring_fd);
+  ring_fd = -1;
+  return -1;
+}
+
+/* post the multishot request for fd */
+static int post_recv(int fd) {
+  ur_fd_t *f = &fds[fd];
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = get_sqe()) == NULL) {
+    log_msg(LOG_ERR, "io_uring: submission queue is full");
+    return -1;
+  }
+  sqe->fd = fd;
+  if (f->ev->type == EV_TCP) {
+    /* connections are accepted by the tcp code itself */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = UR_DATA(UR_POLL, f->gen, fd);
+  } else if (f->ev->type == EV_SENDQ) {
+    /* a full socket, reported once when it can be written to */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = UR_DATA(UR_POLL, f->gen, fd);
+  } else {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr = (unsigned long)&recv_tmpl;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = UR_DATA(UR_RECV, f->gen, fd);
+  }
+  return 0;
+}
+
+/* make room for fd in the fd table */
+static int grow(int fd) {
+  int n = nfds ? nfds : 64;
+  int i;
+
+  while (n <= fd) n *= 2;
+  fds = reallocate(fds, n * sizeof(ur_fd_t));
+  rearm_list = reallocate(rearm_list, n * sizeof(int));
+  memset(&fds[nfds], 0, (n - nfds) * sizeof(ur_fd_t));
+  for (i = nfds; i < n; i++)
+    fds[i].head = fds[i].tail = -1;
+  nfds = n;
+  return 0;
+}
+
+int uring_add(event_t *ev, int fd, int type, void *owner, int idx) {
+  ur_fd_t *f;
+
+  if (fd >= nfds) grow(fd);
+  f = &fds[fd];
+  f->ev = ev;
+  f->head = f->tail = -1;
+  f->rearm = 0;
+  f->round = round - 1;
+  return post_recv(fd);
+}
+
+void uring_del(event_t *ev) {
+  ur_fd_t *f;
+  struct io_uring_sqe *sqe;
+  int bid;
+
+  if (ev->fd < 0 || ev->fd >= nfds || fds[ev->fd].ev != ev) return;
+  f = &fds[ev->fd];
+
+  /* give back the packets nobody read */
+  for (bid = f->head; bid >= 0; bid = buf_next[bid])
+    buf_return(bid);
+  f->head = f->tail = -1;
+
+  /* The posted request holds its own reference to the socket and
+     would outlive close(), so cancel it. Whatever it still completes
+     is dropped because of the new generation. */
+  if ((sqe = get_sqe()) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UR_DATA(ev->type == EV_TCP || ev->type == EV_SENDQ
+			? UR_POLL : UR_RECV, f->gen, ev->fd);
+    sqe->user_data = UR_DATA(UR_CANCEL, 0, 0);
+  }
+  f->ev = NULL;
+  f->rearm = 0;
+  f->gen++;
+}
+
+/* handle one completion. Returns the event to report as ready, if any */
+static event_t *complete(struct io_uring_cqe *cqe) {
+  __u64 d = cqe->user_data;
+  int fd = UR_NUM(d);
+  int bid = -1;
+  ur_fd_t *f;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+  switch (UR_KIND(d)) {
+  case UR_SEND:
+    sendq_done(fd, cqe->res);
+    return NULL;
+  case UR_CANCEL:
+    return NULL;
+  }
+
+  if (fd >= nfds || fds[fd].ev == NULL
+      || (fds[fd].gen & 0xffffff) != UR_GEN(d)) {
+    /* the socket has been unregistered */
+    if (bid >= 0) buf_return(bid);
+    return NULL;
+  }
+  f = &fds[fd];
+
+  if (!(cqe->flags & IORING_CQE_F_MORE) && f->ev->type != EV_SENDQ) {
+    /* The request ended. This happens when we ran out of buffers or
+       the cq overflowed, and then we post it again. */
+    if (cqe->res >= 0 || cqe->res == -ENOBUFS) {
+      if (!f->rearm) rearm_list[nrearm++] = fd;
+      f->rearm = 1;
+    } else
+      log_msg(LOG_ERR, "io_uring: receive on socket %i failed: %s",
+	      fd, strerror(-cqe->res));
+  }
+
+  if (UR_KIND(d) == UR_RECV) {
+    if (bid < 0) return NULL;
+    buf_len[bid] = cqe->res;
+    buf_next[bid] = -1;
+    if (f->tail >= 0) buf_next[f->tail] = bid;
+    else f->head = bid;
+    f->tail = bid;
+  }
+
+  if (f->round == round) return NULL; /* already reported */
+  f->round = round;
+  return f->ev;
+}
+
+int uring_wait(event_t **ready, int max, const struct timespec *tout,
+	       const sigset_t *sigmask) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head, tail;
+  int i, n = 0, rc = 0;
+
+  for (i = 0; i < nrearm; i++) {
+    ur_fd_t *f = &fds[rearm_list[i]];
+    if (f->rearm && f->ev != NULL) post_recv(rearm_list[i]);
+    f->rearm = 0;
+  }
+  nrearm = 0;
+  round++;
+
+  if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head) {
+    /* nothing to reap. Submit our requests and wait in one go */
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask = (unsigned long)sigmask;
+    arg.sigmask_sz = _NSIG / 8;
+    if (tout != NULL) {
+      ts.tv_sec = tout->tv_sec;
+      ts.tv_nsec = tout->tv_nsec;
+      arg.ts = (unsigned long)&ts;
+    }
+    rc = sys_enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		   &arg, sizeof(arg));
+    if (rc > 0) to_submit -= (unsigned)rc > to_submit ? to_submit : rc;
+  } else if (to_submit) {
+    rc = submit();
+  }
+  if (rc < 0) {
+    if (errno == ETIME) return 0;
+    return -1;
+  }
+
+  head = *cq_head;
+  tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail && n < max) {
+    event_t *ev = complete(&cqes[head & *cq_mask]);
+    head++;
+    if (ev != NULL) ready[n++] = ev;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+int uring_recvmsg(int fd, struct msghdr *mh) {
+  struct io_uring_recvmsg_out *out;
+  char *p, *data;
+  ur_fd_t *f;
+  int bid, len, trunc = 0;
+  unsigned hdrlen = sizeof(*out) + recv_tmpl.msg_namelen
+    + recv_tmpl.msg_controllen;
+
+  if (fd < 0 || fd >= nfds || (bid = fds[fd].head) < 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  f = &fds[fd];
+  if ((f->head = buf_next[bid]) < 0) f->tail = -1;
+
+  p = bufs + bid * UR_BUFSIZE;
+  out = (struct io_uring_recvmsg_out *)p;
+  if (buf_len[bid] < (int)hdrlen) {
+    buf_return(bid);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (mh->msg_name != NULL) {
+    len = out->namelen;
+    if (len > (int)recv_tmpl.msg_namelen) len = recv_tmpl.msg_namelen;
+    if (len > (int)mh->msg_namelen) len = mh->msg_namelen;
+    memcpy(mh->msg_name, p + sizeof(*out), len);
+    mh->msg_namelen = out->namelen;
+  }
+  if (mh->msg_control != NULL) {
+    len = out->controllen;
+    if (len > (int)mh->msg_controllen) len = mh->msg_controllen;
+    memcpy(mh->msg_control, p + sizeof(*out) + recv_tmpl.msg_namelen, len);
+    mh->msg_controllen = len;
+  }
+
+  /* the kernel truncates to what fits in the buffer */
+  data = p + hdrlen;
+  len = buf_len[bid] - hdrlen;
+  if (mh->msg_iovlen > 0) {
+    if (len > (int)mh->msg_iov[0].iov_len) {
+      len = mh->msg_iov[0].iov_len;
+      trunc = MSG_TRUNC;
+    }
+    memcpy(mh->msg_iov[0].iov_base, data, len);
+  } else len = 0;
+  mh->msg_flags = out->flags | trunc;
+
+  buf_return(bid);
+  return len;
+}
+
+int uring_sendmsg(int fd, struct msghdr *mh, int slot) {
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = get_sqe()) == NULL) return -1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)mh;
+  sqe->len = 1;
+  sqe->user_data = UR_DATA(UR_SEND, 0, slot);
+  return 0;
+}
+
+#endif /* ENABLE_IO_URING */
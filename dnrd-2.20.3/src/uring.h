@@ -0,0 +1,52 @@
+/*
+ * uring.h - io_uring backend for the relay loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_URING_H_
+#define _DNRD_URING_H_
+
+#include <sys/socket.h>
+#include "event.h"
+
+/* number of receive buffers shared by all sockets, a power of 2 */
+#ifndef URING_NBUFS
+#define URING_NBUFS 256
+#endif
+
+/* submission queue size */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256
+#endif
+
+/* set up the ring. Returns -1 if the kernel can't do what we need */
+int uring_init(void);
+
+/* the event.c backend functions */
+int  uring_add(event_t *ev, int fd, int type, void *owner, int idx);
+void uring_del(event_t *ev);
+int  uring_wait(event_t **ready, int max, const struct timespec *tout,
+		const sigset_t *sigmask);
+
+/* hand out the next packet received on fd, like recvmsg() on a
+   non-blocking socket */
+int  uring_recvmsg(int fd, struct msghdr *mh);
+
+/* queue a sendmsg(). mh must stay valid until sendq_done(slot) is
+   called with the result. Returns -1 if it couldn't be queued. */
+int  uring_sendmsg(int fd, struct msghdr *mh, int slot);
+
+#endif /* _DNRD_URING_H_ */
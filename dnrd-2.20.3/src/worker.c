@@ -0,0 +1,108 @@
+/*
+ * worker.c - run the relay in several processes
+ *
+ * With --workers=N the relay loop runs in N processes. Every worker has
+ * its own SO_REUSEPORT listeners, so the kernel spreads the clients over
+ * them, and its own query list, qid pool, cache and upstream sockets.
+ * Only the server lists are shared, so that a server that stops
+ * answering is taken out of use by all workers at once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+#include "common.h"
+#include "qid.h"
+#include "worker.h"
+#include "listener.h"
+
+int workers = 1;
+int worker_pin = 0;
+int worker_cpu = -1;
+int worker_id = 0;
+
+void worker_share_servers(void) {
+  infnode_t *i = inf_list;
+
+  do {
+    i->srvlist = share_srvlist(i->srvlist);
+    i->current = NULL;
+  } while ((i = i->next) != inf_list);
+}
+
+static void pin_cpu(void) {
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t set;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  long cpu;
+
+  if (ncpu < 1) ncpu = 1;
+  cpu = ((worker_cpu >= 0 ? worker_cpu : 0) + worker_id) % ncpu;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    log_msg(LOG_WARNING, "worker %i: couldn't pin to cpu %li: %s",
+	    worker_id, cpu, strerror(errno));
+  else
+    log_debug(1, "worker %i: pinned to cpu %li", worker_id, cpu);
+#else
+  log_msg(LOG_WARNING, "cpu pinning is not supported on this system");
+#endif
+}
+
+void worker_start(void) {
+  pid_t pid;
+  int i;
+
+  for (i = 1; i < workers; i++) {
+    if ((pid = fork()) < 0)
+      log_err_exit(-1, "worker %i: couldn't fork: %s", i, strerror(errno));
+    if (pid == 0) {
+      worker_id = i;
+      break;
+    }
+  }
+
+  if (worker_id > 0) {
+#ifdef HAVE_SYS_PRCTL_H
+    /* go away with the first worker */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    if (getppid() == 1) exit(0);
+    /* don't hand out the same qids as the other workers */
+    qid_init_pool();
+  }
+
+  listener_keep(worker_id);
+
+  if (worker_pin) pin_cpu();
+  if (workers > 1)
+    log_debug(1, "worker %i started with pid %i", worker_id, (int)getpid());
+}
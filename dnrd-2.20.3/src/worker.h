@@ -0,0 +1,39 @@
+/*
+ * worker.h - run the relay in several processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _DNRD_WORKER_H_
+#define _DNRD_WORKER_H_
+
+/* upper limit for --workers */
+#ifndef WORKERS_MAX
+#define WORKERS_MAX 64
+#endif
+
+extern int workers;     /* number of relay processes */
+extern int worker_pin;  /* pin each worker to its own cpu */
+extern int worker_cpu;  /* the cpu of the first worker, -1 for cpu 0 */
+extern int worker_id;   /* 0 in the first process, 1..workers-1 in the rest */
+
+/* move the server lists to shared memory. Call before worker_start() */
+void worker_share_servers(void);
+
+/* fork the other workers. Each process continues with its own
+   listener, query list and qid pool */
+void worker_start(void);
+
+#endif /* _DNRD_WORKER_H_ */